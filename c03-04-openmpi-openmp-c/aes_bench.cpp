@@ -0,0 +1,407 @@
+// Micro-benchmark for the aescrypt library: throughput of every mode and
+// direction over a range of buffer sizes, OpenMP thread counts and AES
+// kernels. Results go out as CSV or JSON, one row per measurement. Before a
+// kernel is timed, its output for the first buffer of every mode is checked
+// against OpenSSL, so a kernel that computes the wrong thing fails the run
+// instead of reporting good throughput.
+//
+//   aes_bench [--sizes 1K,64K,1G] [--threads 1,2,4] [--kernels evp,soft,aesni,vaes]
+//             [--min-time SECONDS] [--format csv|json] [--output FILE]
+#include "aescrypt.h"
+
+#include <omp.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <openssl/rand.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace {
+
+const std::string BENCH_KEY = "0123456789abcdef";
+
+struct BenchOptions {
+    std::vector<size_t> sizes;
+    std::vector<int> threads;
+    std::vector<std::string> kernels;
+    double min_time = 0.2;
+    std::string format = "csv";
+    std::string output;
+};
+
+struct Result {
+    std::string path;
+    std::string kernel;
+    std::string mode;
+    std::string direction;
+    size_t size;
+    int threads;
+    long long iterations;
+    double seconds;
+    double cycles;
+};
+
+// One timed operation on a `size`-byte buffer; false on failure.
+typedef std::function<bool(size_t size)> Operation;
+
+// Reference cycles from the TSC; 0 where there is none.
+unsigned long long read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+std::vector<std::string> split_list(const std::string& text) {
+    std::vector<std::string> items;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+// `len` bytes of `input` through a one-shot OpenSSL context, the reference for
+// the known-answer checks.
+std::vector<unsigned char> openssl_reference(const EVP_CIPHER* type, bool encrypt, const unsigned char* iv,
+                                             const unsigned char* input, size_t len, bool padding = false) {
+    std::vector<unsigned char> output(len + AES_BLOCK_SIZE);
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    long long output_len = 0;
+    int final_len = 0;
+    bool ok = ctx && EVP_CipherInit_ex(ctx, type, NULL, reinterpret_cast<const unsigned char*>(BENCH_KEY.data()), iv,
+                                       encrypt ? 1 : 0) == 1 &&
+              EVP_CIPHER_CTX_set_padding(ctx, padding ? 1 : 0) == 1 &&
+              cipher_update(ctx, output.data(), output_len, input, len) &&
+              EVP_CipherFinal_ex(ctx, output.data() + output_len, &final_len) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    if (!ok) {
+        throw std::runtime_error("OpenSSL reference failed");
+    }
+    output.resize(output_len + final_len);
+    return output;
+}
+
+// Throws unless the `len` bytes at `actual` are `expected`.
+void check_output(const unsigned char* actual, long long len, const std::vector<unsigned char>& expected,
+                  const std::string& what) {
+    if (len < 0 || static_cast<size_t>(len) != expected.size() ||
+        !std::equal(expected.begin(), expected.end(), actual)) {
+        throw std::runtime_error(what + " does not match OpenSSL");
+    }
+}
+
+// Selects `kernel` for the pools built from here on; false if this CPU
+// would quietly run a different one.
+bool select_kernel(const std::string& kernel) {
+    setenv("AESCRYPT_KERNEL", kernel.c_str(), 1);
+    return aes_kernel_name(detect_aes_kernel()) == kernel;
+}
+
+BenchOptions parse_options(int argc, char* argv[]) {
+    BenchOptions options;
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            throw std::invalid_argument("missing value for " + option);
+        }
+        std::string value = argv[++i];
+        if (option == "--sizes") {
+            for (const std::string& size : split_list(value)) {
+                options.sizes.push_back(parse_size(size));
+            }
+        } else if (option == "--threads") {
+            for (const std::string& count : split_list(value)) {
+                options.threads.push_back(std::stoi(count));
+            }
+        } else if (option == "--kernels") {
+            options.kernels = split_list(value);
+        } else if (option == "--min-time") {
+            options.min_time = std::stod(value);
+        } else if (option == "--format") {
+            options.format = value;
+        } else if (option == "--output") {
+            options.output = value;
+        } else {
+            throw std::invalid_argument("unknown option " + option);
+        }
+    }
+
+    if (options.sizes.empty()) {
+        // 1 KiB to 1 GiB in steps of four
+        for (size_t size = 1 << 10; size <= (size_t(1) << 30); size <<= 2) {
+            options.sizes.push_back(size);
+        }
+    }
+    if (options.threads.empty()) {
+        int max_threads = omp_get_max_threads();
+        for (int count = 1; count < max_threads; count *= 2) {
+            options.threads.push_back(count);
+        }
+        options.threads.push_back(max_threads);
+    }
+    if (options.kernels.empty()) {
+        // every kernel; the ones this CPU lacks are skipped
+        options.kernels = {"evp", "soft", "aesni", "vaes"};
+    }
+    for (size_t size : options.sizes) {
+        if (size == 0 || size % AES_BLOCK_SIZE != 0) {
+            throw std::invalid_argument("sizes must be non-zero multiples of 16 bytes");
+        }
+    }
+    if (options.format != "csv" && options.format != "json") {
+        throw std::invalid_argument("format must be csv or json");
+    }
+    return options;
+}
+
+class Bench {
+private:
+    const BenchOptions& options;
+    std::vector<unsigned char> input;
+    std::vector<unsigned char> output;
+    std::vector<unsigned char> ciphertext;
+
+public:
+    std::vector<Result> results;
+
+    Bench(const BenchOptions& options, size_t max_size) : options(options) {
+        // room for a padding block and a segment table on top of the data
+        size_t capacity = max_size + max_size / SEGMENT_SIZE * SegmentedContainer::ENTRY_SIZE + 4096;
+        input.resize(capacity);
+        output.resize(capacity);
+        ciphertext.resize(capacity);
+        for (size_t done = 0; done < max_size; done += 1 << 20) {
+            RAND_bytes(input.data() + done, std::min<size_t>(1 << 20, max_size - done));
+        }
+    }
+
+    const unsigned char* in() const { return input.data(); }
+    unsigned char* out() { return output.data(); }
+    unsigned char* cipher_buffer() { return ciphertext.data(); }
+    size_t capacity() const { return output.size(); }
+
+    // Runs `operation` once to warm up, then until --min-time has passed.
+    void measure(const std::string& path, const std::string& kernel, const std::string& mode,
+                 const std::string& direction, size_t size, int threads, const Operation& operation) {
+        if (!operation(size)) {
+            throw std::runtime_error(path + " " + mode + " " + direction + " failed");
+        }
+
+        long long iterations = 0;
+        auto start = std::chrono::steady_clock::now();
+        unsigned long long start_cycles = read_cycles();
+        double seconds = 0;
+        do {
+            operation(size);
+            iterations++;
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } while (seconds < options.min_time);
+        double cycles = static_cast<double>(read_cycles() - start_cycles);
+
+        results.push_back({path, kernel, mode, direction, size, threads, iterations, seconds, cycles});
+        std::cerr << path << " " << kernel << " " << mode << " " << direction << " " << size << " B x"
+                  << threads << ": " << size * iterations / seconds / 1e9 << " GB/s" << std::endl;
+    }
+};
+
+// The OpenMP loops of CipherContextPool, which is where the kernels plug in.
+// The kernel comes from select_kernel().
+void bench_pool(Bench& bench, const std::string& kernel, int threads, const std::vector<size_t>& sizes) {
+    AESCipher cipher(BENCH_KEY);
+    const unsigned char* iv = cipher.get_iv();
+    CipherContextPool ecb_encrypt(EVP_aes_128_ecb(), cipher, true, threads);
+    CipherContextPool ecb_decrypt(EVP_aes_128_ecb(), cipher, false, threads);
+    CipherContextPool ctr(EVP_aes_128_ctr(), cipher, true, threads);
+    CipherContextPool cbc_decrypt(EVP_aes_128_cbc(), cipher, false, threads);
+
+    // Known answers for the first buffer. The CTR counter starts three blocks
+    // short of a carry out of its low 64 bits, and the ECB and CBC
+    // decryptions run on the reference ciphertext.
+    size_t len = sizes.front();
+    const std::string what = "pool " + kernel + " x" + std::to_string(threads) + " ";
+    unsigned char check_iv[AES_BLOCK_SIZE];
+    RAND_bytes(check_iv, AES_BLOCK_SIZE);
+    std::fill(check_iv + 8, check_iv + AES_BLOCK_SIZE, 0xff);
+    check_iv[AES_BLOCK_SIZE - 1] = 0xfd;
+    std::vector<unsigned char> ecb = openssl_reference(EVP_aes_128_ecb(), true, nullptr, bench.in(), len);
+    std::vector<unsigned char> cbc = openssl_reference(EVP_aes_128_cbc(), true, check_iv, bench.in(), len);
+    std::vector<unsigned char> plain(bench.in(), bench.in() + len);
+    check_output(bench.out(), ecb_encrypt.update_blocks(bench.in(), bench.out(), len / AES_BLOCK_SIZE), ecb,
+                 what + "aes-128-ecb encrypt");
+    check_output(bench.out(), ecb_decrypt.update_blocks(ecb.data(), bench.out(), len / AES_BLOCK_SIZE), plain,
+                 what + "aes-128-ecb decrypt");
+    check_output(bench.out(), ctr.update_counter(bench.in(), bench.out(), len, check_iv, 0),
+                 openssl_reference(EVP_aes_128_ctr(), true, check_iv, bench.in(), len), what + "aes-128-ctr encrypt");
+    check_output(bench.out(), cbc_decrypt.update_chained(cbc.data(), bench.out(), len, check_iv), plain,
+                 what + "aes-128-cbc decrypt");
+
+    for (size_t size : sizes) {
+        bench.measure("pool", kernel, "aes-128-ecb", "encrypt", size, threads, [&](size_t len) {
+            return ecb_encrypt.update_blocks(bench.in(), bench.out(), len / AES_BLOCK_SIZE) >= 0;
+        });
+        bench.measure("pool", kernel, "aes-128-ecb", "decrypt", size, threads, [&](size_t len) {
+            return ecb_decrypt.update_blocks(bench.in(), bench.out(), len / AES_BLOCK_SIZE) >= 0;
+        });
+        bench.measure("pool", kernel, "aes-128-ctr", "encrypt", size, threads, [&](size_t len) {
+            return ctr.update_counter(bench.in(), bench.out(), len, iv, 0) >= 0;
+        });
+        bench.measure("pool", kernel, "aes-128-cbc", "decrypt", size, threads, [&](size_t len) {
+            return cbc_decrypt.update_chained(bench.in(), bench.out(), len, iv) >= 0;
+        });
+    }
+}
+
+// Known answers for the engine's first buffer, already encrypted into the
+// cipher buffer: the standard modes must produce what OpenSSL does (CTR with
+// the counter block it stored in front), and every mode must decrypt back to
+// the input. The containers have random IVs, so only the round trip applies.
+void check_engine(Bench& bench, const std::string& kernel, int threads, const std::string& mode, size_t size,
+                  long long encrypted_len, AESCryptEngine& decryptor) {
+    const std::string what = "engine " + kernel + " x" + std::to_string(threads) + " " + mode;
+    const unsigned char* ciphertext = bench.cipher_buffer();
+    if (mode == "aes-128-ecb") {
+        check_output(ciphertext, encrypted_len,
+                     openssl_reference(EVP_aes_128_ecb(), true, nullptr, bench.in(), size, true), what + " encrypt");
+    } else if (mode == "aes-128-cbc") {
+        unsigned char zero_iv[AES_BLOCK_SIZE] = {};
+        check_output(ciphertext, encrypted_len,
+                     openssl_reference(EVP_aes_128_cbc(), true, zero_iv, bench.in(), size, true), what + " encrypt");
+    } else if (mode == "aes-128-ctr") {
+        check_output(ciphertext + CTR_HEADER_SIZE, encrypted_len - CTR_HEADER_SIZE,
+                     openssl_reference(EVP_aes_128_ctr(), true, ciphertext, bench.in(), size), what + " encrypt");
+    }
+    check_output(bench.out(), decryptor.process(ciphertext, encrypted_len, bench.out(), bench.capacity()),
+                 std::vector<unsigned char>(bench.in(), bench.in() + size), what + " decrypt");
+}
+
+// Whole streams through AESCryptEngine, padding and container included. CBC
+// encryption and GCM are EVP whatever the kernel.
+void bench_engine(Bench& bench, const std::string& kernel, int threads, const std::vector<size_t>& sizes) {
+    for (const std::string mode : {"aes-128-ecb", "aes-128-cbc", "aes-128-ctr", "aes-128-cbc-seg", "aes-128-gcm"}) {
+        AESCryptEngine encryptor(BENCH_KEY, "encrypt", mode, threads);
+        AESCryptEngine decryptor(BENCH_KEY, "decrypt", mode, threads);
+
+        for (size_t size : sizes) {
+            long long encrypted_len = encryptor.process(bench.in(), size, bench.cipher_buffer(), bench.capacity());
+            if (encrypted_len < 0) {
+                throw std::runtime_error("engine " + mode + " encrypt failed");
+            }
+            if (size == sizes.front()) {
+                check_engine(bench, kernel, threads, mode, size, encrypted_len, decryptor);
+            }
+            bench.measure("engine", kernel, mode, "encrypt", size, threads, [&](size_t len) {
+                return encryptor.process(bench.in(), len, bench.out(), bench.capacity()) >= 0;
+            });
+            bench.measure("engine", kernel, mode, "decrypt", size, threads, [&](size_t) {
+                return decryptor.process(bench.cipher_buffer(), encrypted_len, bench.out(), bench.capacity()) >= 0;
+            });
+        }
+    }
+}
+
+// The serial AESCipher methods: one EVP context, no OpenMP.
+void bench_cipher(Bench& bench, const std::vector<size_t>& sizes) {
+    unsetenv("AESCRYPT_KERNEL");
+    AESCipher cipher(BENCH_KEY);
+
+    for (size_t size : sizes) {
+        long long ecb_len = cipher.encrypt_aes_ecb(bench.in(), size, bench.cipher_buffer());
+        bench.measure("aescipher", "evp", "aes-128-ecb", "encrypt", size, 1, [&](size_t len) {
+            return cipher.encrypt_aes_ecb(bench.in(), len, bench.out()) >= 0;
+        });
+        bench.measure("aescipher", "evp", "aes-128-ecb", "decrypt", size, 1, [&](size_t) {
+            return cipher.decrypt_aes_ecb(bench.cipher_buffer(), ecb_len, bench.out()) >= 0;
+        });
+
+        long long cbc_len = cipher.encrypt_aes_cbc(bench.in(), size, bench.cipher_buffer());
+        bench.measure("aescipher", "evp", "aes-128-cbc", "encrypt", size, 1, [&](size_t len) {
+            return cipher.encrypt_aes_cbc(bench.in(), len, bench.out()) >= 0;
+        });
+        bench.measure("aescipher", "evp", "aes-128-cbc", "decrypt", size, 1, [&](size_t) {
+            return cipher.decrypt_aes_cbc(bench.cipher_buffer(), cbc_len, bench.out()) >= 0;
+        });
+    }
+}
+
+void write_results(const std::vector<Result>& results, const std::string& format, std::ostream& out) {
+    if (format == "csv") {
+        out << "path,kernel,mode,direction,size,threads,iterations,seconds,gb_per_s,cycles_per_byte\n";
+    } else {
+        out << "[\n";
+    }
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        double bytes = static_cast<double>(r.size) * r.iterations;
+        double gbps = bytes / r.seconds / 1e9;
+        double cycles_per_byte = r.cycles / bytes;
+
+        if (format == "csv") {
+            out << r.path << "," << r.kernel << "," << r.mode << "," << r.direction << "," << r.size << ","
+                << r.threads << "," << r.iterations << "," << r.seconds << "," << gbps << "," << cycles_per_byte
+                << "\n";
+        } else {
+            out << "  {\"path\": \"" << r.path << "\", \"kernel\": \"" << r.kernel << "\", \"mode\": \"" << r.mode
+                << "\", \"direction\": \"" << r.direction << "\", \"size\": " << r.size
+                << ", \"threads\": " << r.threads << ", \"iterations\": " << r.iterations
+                << ", \"seconds\": " << r.seconds << ", \"gb_per_s\": " << gbps
+                << ", \"cycles_per_byte\": " << cycles_per_byte << "}" << (i + 1 < results.size() ? "," : "")
+                << "\n";
+        }
+    }
+
+    if (format == "json") {
+        out << "]\n";
+    }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    try {
+        BenchOptions options = parse_options(argc, argv);
+        Bench bench(options, *std::max_element(options.sizes.begin(), options.sizes.end()));
+
+        bench_cipher(bench, options.sizes);
+        for (const std::string& kernel : options.kernels) {
+            if (!select_kernel(kernel)) {
+                std::cerr << "Kernel " << kernel << " is not available here, skipping." << std::endl;
+                continue;
+            }
+            for (int threads : options.threads) {
+                bench_pool(bench, kernel, threads, options.sizes);
+                bench_engine(bench, kernel, threads, options.sizes);
+            }
+        }
+
+        if (options.output.empty()) {
+            write_results(bench.results, options.format, std::cout);
+        } else {
+            std::ofstream out(options.output);
+            write_results(bench.results, options.format, out);
+            if (!out) {
+                throw std::runtime_error("Failed to write " + options.output);
+            }
+            std::cout << "Wrote " << bench.results.size() << " results to " << options.output << std::endl;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,1031 @@
+#include "aescrypt.h"
+
+#include <omp.h>
+#include <algorithm>
+#include <cstring>
+#include <list>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+
+Range partition_range(size_t total, size_t parts, size_t index, size_t alignment) {
+    size_t units = total / alignment;
+    Range range;
+    range.begin = units * index / parts * alignment;
+    range.end = (index + 1 == parts) ? total : units * (index + 1) / parts * alignment;
+    return range;
+}
+
+int pkcs7_padding_length(const unsigned char* block) {
+    int pad = block[AES_BLOCK_SIZE - 1];
+    if (pad < 1 || pad > AES_BLOCK_SIZE) {
+        return -1;
+    }
+    for (int i = AES_BLOCK_SIZE - pad; i < AES_BLOCK_SIZE; i++) {
+        if (block[i] != pad) {
+            return -1;
+        }
+    }
+    return pad;
+}
+
+void advance_counter(unsigned char counter[AES_BLOCK_SIZE], uint64_t blocks) {
+    for (int i = AES_BLOCK_SIZE - 1; i >= 0 && blocks > 0; i--) {
+        uint64_t sum = counter[i] + (blocks & 0xff);
+        counter[i] = static_cast<unsigned char>(sum);
+        blocks = (blocks >> 8) + (sum >> 8);
+    }
+}
+
+size_t parse_size(const std::string& text) {
+    size_t pos = 0;
+    unsigned long long value = std::stoull(text, &pos);
+    std::string suffix = text.substr(pos);
+    if (suffix == "K" || suffix == "k") {
+        value <<= 10;
+    } else if (suffix == "M" || suffix == "m") {
+        value <<= 20;
+    } else if (suffix == "G" || suffix == "g") {
+        value <<= 30;
+    } else if (!suffix.empty()) {
+        throw std::invalid_argument("bad size suffix");
+    }
+    return value;
+}
+
+bool cipher_update(EVP_CIPHER_CTX* ctx, unsigned char* output, long long& output_len,
+                   const unsigned char* input, size_t len) {
+    for (size_t done = 0; done < len; done += MAX_UPDATE_SIZE) {
+        int chunk_len;
+        if (EVP_CipherUpdate(ctx, output + output_len, &chunk_len, input + done,
+                             std::min(MAX_UPDATE_SIZE, len - done)) != 1) {
+            return false;
+        }
+        output_len += chunk_len;
+    }
+    return true;
+}
+
+KeySchedule::KeySchedule(const unsigned char* key) {
+    std::copy(key, key + 16, this->key);
+}
+
+KeySchedule::~KeySchedule() {
+    for (auto& context : contexts) {
+        EVP_CIPHER_CTX_free(context.ctx);
+    }
+    for (auto& native : native_keys) {
+        OPENSSL_cleanse(native.keys.get(), sizeof(AesRoundKeys));
+    }
+    OPENSSL_cleanse(key, sizeof(key));
+}
+
+bool KeySchedule::matches(const unsigned char* key) const {
+    return CRYPTO_memcmp(this->key, key, sizeof(this->key)) == 0;
+}
+
+const EVP_CIPHER_CTX* KeySchedule::context(const EVP_CIPHER* type, bool encrypt) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto& context : contexts) {
+        if (context.type == type && context.encrypt == encrypt) {
+            return context.ctx;
+        }
+    }
+
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (!ctx || EVP_CipherInit_ex(ctx, type, NULL, key, NULL, encrypt ? 1 : 0) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return nullptr;
+    }
+    contexts.push_back({type, encrypt, ctx});
+    return ctx;
+}
+
+const AesRoundKeys& KeySchedule::round_keys(AesKernel kernel) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto& native : native_keys) {
+        if (native.kernel == kernel) {
+            return *native.keys;
+        }
+    }
+
+    std::unique_ptr<AesRoundKeys> keys(new AesRoundKeys);
+    aes_expand_key(kernel, key, *keys);
+    native_keys.push_back({kernel, std::move(keys)});
+    return *native_keys.back().keys;
+}
+
+// Most recently used first. OpenSSL is initialized before the cache exists, so
+// its exit handler runs after the cache has freed its contexts.
+struct KeyCacheState {
+    std::mutex mutex;
+    size_t capacity = KEY_CACHE_CAPACITY;
+    std::list<std::shared_ptr<KeySchedule>> schedules;
+
+    KeyCacheState() {
+        OPENSSL_init_crypto(0, NULL);
+    }
+};
+
+static KeyCacheState& key_cache() {
+    static KeyCacheState state;
+    return state;
+}
+
+std::shared_ptr<KeySchedule> KeyCache::get(const unsigned char* key) {
+    KeyCacheState& cache = key_cache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    for (auto it = cache.schedules.begin(); it != cache.schedules.end(); ++it) {
+        if ((*it)->matches(key)) {
+            cache.schedules.splice(cache.schedules.begin(), cache.schedules, it);
+            return cache.schedules.front();
+        }
+    }
+
+    // schedules that fall out stay alive for as long as a cipher holds them
+    auto schedule = std::make_shared<KeySchedule>(key);
+    if (cache.capacity > 0) {
+        cache.schedules.push_front(schedule);
+        if (cache.schedules.size() > cache.capacity) {
+            cache.schedules.pop_back();
+        }
+    }
+    return schedule;
+}
+
+void KeyCache::set_capacity(size_t capacity) {
+    KeyCacheState& cache = key_cache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.capacity = capacity;
+    while (cache.schedules.size() > capacity) {
+        cache.schedules.pop_back();
+    }
+}
+
+size_t KeyCache::size() {
+    KeyCacheState& cache = key_cache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    return cache.schedules.size();
+}
+
+// Update and final over a prepared context. Returns the bytes written or -1.
+static long long run_cipher(EVP_CIPHER_CTX* ctx, unsigned char* output, const unsigned char* input, size_t len) {
+    long long output_len = 0;
+    int final_len;
+    if (!ctx || !cipher_update(ctx, output, output_len, input, len) ||
+        EVP_CipherFinal_ex(ctx, output + output_len, &final_len) != 1) {
+        return -1;
+    }
+    return output_len + final_len;
+}
+
+AESCipher::AESCipher(const std::string& key_str) {
+    if (key_str.size() != 16) {
+        throw std::invalid_argument("Key must be 16 bytes for AES-128");
+    }
+    std::copy(key_str.begin(), key_str.end(), key);
+    // Initialize IV to zero or any other value
+    std::fill(iv, iv + 16, 0);
+    schedule = KeyCache::get(key);
+}
+
+const unsigned char* AESCipher::get_key() const {
+    return key;
+}
+
+const unsigned char* AESCipher::get_iv() const {
+    return iv;
+}
+
+void AESCipher::set_iv(const unsigned char* iv) {
+    std::copy(iv, iv + AES_BLOCK_SIZE, this->iv);
+}
+
+EVP_CIPHER_CTX* AESCipher::clone_context(const EVP_CIPHER* type, bool encrypt) const {
+    const EVP_CIPHER_CTX* keyed = schedule->context(type, encrypt);
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (!keyed || !ctx || EVP_CIPHER_CTX_copy(ctx, keyed) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return nullptr;
+    }
+    return ctx;
+}
+
+const AesRoundKeys& AESCipher::round_keys(AesKernel kernel) const {
+    return schedule->round_keys(kernel);
+}
+
+EVP_CIPHER_CTX* AESCipher::prepare(const EVP_CIPHER* type, bool encrypt, const unsigned char* iv,
+                                   bool padding) const {
+    static thread_local std::unique_ptr<EVP_CIPHER_CTX, void (*)(EVP_CIPHER_CTX*)> scratch(
+        EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+
+    // the reset drops whatever the last call left behind; the copy brings the
+    // expanded key back, so only the IV is new
+    const EVP_CIPHER_CTX* keyed = schedule->context(type, encrypt);
+    EVP_CIPHER_CTX* ctx = scratch.get();
+    if (!keyed || !ctx || EVP_CIPHER_CTX_reset(ctx) != 1 || EVP_CIPHER_CTX_copy(ctx, keyed) != 1 ||
+        EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1) != 1) {
+        return nullptr;
+    }
+    EVP_CIPHER_CTX_set_padding(ctx, padding ? 1 : 0);
+    return ctx;
+}
+
+long long AESCipher::encrypt_aes_cbc(const unsigned char* plaintext, size_t plaintext_len,
+                                     unsigned char* ciphertext, const unsigned char* chain_iv, bool padding) {
+    EVP_CIPHER_CTX* ctx = prepare(EVP_aes_128_cbc(), true, chain_iv ? chain_iv : iv, padding);
+    return run_cipher(ctx, ciphertext, plaintext, plaintext_len);
+}
+
+long long AESCipher::encrypt_aes_ecb(const unsigned char* plaintext, size_t plaintext_len,
+                                     unsigned char* ciphertext) {
+    EVP_CIPHER_CTX* ctx = prepare(EVP_aes_128_ecb(), true, NULL, true);
+    return run_cipher(ctx, ciphertext, plaintext, plaintext_len);
+}
+
+long long AESCipher::decrypt_aes_cbc(const unsigned char* ciphertext, size_t ciphertext_len,
+                                     unsigned char* plaintext, const unsigned char* chain_iv, bool padding) {
+    EVP_CIPHER_CTX* ctx = prepare(EVP_aes_128_cbc(), false, chain_iv ? chain_iv : iv, padding);
+    return run_cipher(ctx, plaintext, ciphertext, ciphertext_len);
+}
+
+long long AESCipher::decrypt_aes_ecb(const unsigned char* ciphertext, size_t ciphertext_len,
+                                     unsigned char* plaintext) {
+    EVP_CIPHER_CTX* ctx = prepare(EVP_aes_128_ecb(), false, NULL, true);
+    return run_cipher(ctx, plaintext, ciphertext, ciphertext_len);
+}
+
+ThreadSpans::ThreadSpans(int threads) : spans(threads) {}
+
+void ThreadSpans::add(int thread, double begin, double end, size_t bytes) {
+    if (thread < static_cast<int>(spans.size())) {
+        spans[thread].push_back({begin, end, bytes});
+    }
+}
+
+int ThreadSpans::thread_count() const {
+    return spans.size();
+}
+
+const std::vector<ThreadSpans::Span>& ThreadSpans::of(int thread) const {
+    return spans[thread];
+}
+
+CipherContextPool::CipherContextPool(const EVP_CIPHER* type, const AESCipher& cipher, bool encrypt, int threads)
+    : encrypt(encrypt) {
+    if (type == EVP_aes_128_ecb()) {
+        native = NativeMode::Ecb;
+    } else if (type == EVP_aes_128_ctr()) {
+        native = NativeMode::Ctr;
+    } else if (type == EVP_aes_128_cbc() && !encrypt) {
+        native = NativeMode::CbcDecrypt;
+    }
+    if (native != NativeMode::None) {
+        kernel = detect_aes_kernel();
+    }
+    if (kernel != AesKernel::Evp) {
+        round_keys = cipher.round_keys(kernel);
+    }
+
+    contexts.resize(threads > 0 ? threads : omp_get_max_threads(), nullptr);
+    for (auto& ctx : contexts) {
+        ctx = cipher.clone_context(type, encrypt);
+        if (!ctx) {
+            release();
+            throw std::runtime_error("Failed to initialize cipher context pool.");
+        }
+        EVP_CIPHER_CTX_set_padding(ctx, 0);
+    }
+}
+
+CipherContextPool::~CipherContextPool() {
+    release();
+}
+
+int CipherContextPool::thread_count() const {
+    return contexts.size();
+}
+
+AesKernel CipherContextPool::get_kernel() const {
+    return kernel;
+}
+
+void CipherContextPool::record_spans(ThreadSpans* spans) {
+    this->spans = spans;
+}
+
+bool CipherContextPool::transform(int thread, const unsigned char* iv, const unsigned char* input,
+                                  unsigned char* output, size_t len) {
+    double begin = spans ? omp_get_wtime() : 0;
+    bool ok = true;
+    if (kernel != AesKernel::Evp) {
+        native_update(iv, input, output, len);
+    } else {
+        long long len_out = 0;
+        ok = EVP_CipherInit_ex(contexts[thread], NULL, NULL, NULL, iv, -1) == 1 &&
+             cipher_update(contexts[thread], output, len_out, input, len);
+    }
+    if (spans) {
+        spans->add(thread, begin, omp_get_wtime(), len);
+    }
+    return ok;
+}
+
+long long CipherContextPool::update_blocks(const unsigned char* input, unsigned char* output, size_t num_blocks) {
+    bool failed = false;
+
+    #pragma omp parallel num_threads(thread_count()) proc_bind(spread)
+    {
+        int thread = omp_get_thread_num();
+        Range range = partition_range(num_blocks * AES_BLOCK_SIZE, omp_get_num_threads(), thread, THREAD_ALIGNMENT);
+        double begin = spans ? omp_get_wtime() : 0;
+
+        if (range.size() > 0 && kernel != AesKernel::Evp) {
+            native_update(nullptr, input + range.begin, output + range.begin, range.size());
+        } else if (range.size() > 0) {
+            long long len = 0;
+            if (!cipher_update(contexts[thread], output + range.begin, len,
+                               input + range.begin, range.size())) {
+                #pragma omp atomic write
+                failed = true;
+            }
+        }
+        if (spans && range.size() > 0) {
+            spans->add(thread, begin, omp_get_wtime(), range.size());
+        }
+    }
+
+    return failed ? -1 : static_cast<long long>(num_blocks * AES_BLOCK_SIZE);
+}
+
+long long CipherContextPool::update_counter(const unsigned char* input, unsigned char* output, size_t len,
+                                            const unsigned char* base_iv, uint64_t first_block) {
+    bool failed = false;
+
+    #pragma omp parallel num_threads(thread_count()) proc_bind(spread)
+    {
+        int thread = omp_get_thread_num();
+        Range range = partition_range(len, omp_get_num_threads(), thread, THREAD_ALIGNMENT);
+
+        if (range.size() > 0) {
+            unsigned char counter[AES_BLOCK_SIZE];
+            std::copy(base_iv, base_iv + AES_BLOCK_SIZE, counter);
+            advance_counter(counter, first_block + range.begin / AES_BLOCK_SIZE);
+
+            if (!transform(thread, counter, input + range.begin, output + range.begin, range.size())) {
+                #pragma omp atomic write
+                failed = true;
+            }
+        }
+    }
+
+    return failed ? -1 : static_cast<long long>(len);
+}
+
+long long CipherContextPool::update_chained(const unsigned char* input, unsigned char* output, size_t len,
+                                            const unsigned char* previous_block) {
+    bool failed = false;
+
+    #pragma omp parallel num_threads(thread_count()) proc_bind(spread)
+    {
+        int thread = omp_get_thread_num();
+        Range range = partition_range(len, omp_get_num_threads(), thread, THREAD_ALIGNMENT);
+
+        // in place, the left neighbour thread overwrites the block in front of
+        // this range: every thread takes its copy before anyone starts
+        unsigned char chain_iv[AES_BLOCK_SIZE];
+        const unsigned char* chain_from = range.begin > 0 ? input + range.begin - AES_BLOCK_SIZE : previous_block;
+        if (range.size() > 0) {
+            std::copy(chain_from, chain_from + AES_BLOCK_SIZE, chain_iv);
+        }
+        #pragma omp barrier
+
+        if (range.size() > 0) {
+            if (!transform(thread, chain_iv, input + range.begin, output + range.begin, range.size())) {
+                #pragma omp atomic write
+                failed = true;
+            }
+        }
+    }
+
+    return failed ? -1 : static_cast<long long>(len);
+}
+
+bool CipherContextPool::transform_aead(int thread, const unsigned char* nonce, const unsigned char* aad, size_t aad_len,
+                                       const unsigned char* input, unsigned char* output, size_t len,
+                                       unsigned char* tag) {
+    double begin = spans ? omp_get_wtime() : 0;
+    EVP_CIPHER_CTX* ctx = contexts[thread];
+    long long len_out = 0;
+    int aad_out, final_len;
+
+    // the tag to check has to be in place before the final call verifies it
+    bool ok = EVP_CipherInit_ex(ctx, NULL, NULL, NULL, nonce, -1) == 1 &&
+              EVP_CipherUpdate(ctx, NULL, &aad_out, aad, aad_len) == 1 &&
+              cipher_update(ctx, output, len_out, input, len) &&
+              (encrypt || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, GCM_TAG_SIZE, tag) == 1) &&
+              EVP_CipherFinal_ex(ctx, output + len_out, &final_len) == 1 &&
+              (!encrypt || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, GCM_TAG_SIZE, tag) == 1);
+    if (spans) {
+        spans->add(thread, begin, omp_get_wtime(), len);
+    }
+    return ok;
+}
+
+void CipherContextPool::native_update(const unsigned char* iv, const unsigned char* input, unsigned char* output,
+                                      size_t len) const {
+    switch (native) {
+        case NativeMode::Ecb:
+            if (encrypt) {
+                aes_ecb_encrypt(kernel, round_keys, input, output, len / AES_BLOCK_SIZE);
+            } else {
+                aes_ecb_decrypt(kernel, round_keys, input, output, len / AES_BLOCK_SIZE);
+            }
+            break;
+        case NativeMode::Ctr:
+            aes_ctr_xor(kernel, round_keys, iv, input, output, len);
+            break;
+        case NativeMode::CbcDecrypt:
+            aes_cbc_decrypt(kernel, round_keys, iv, input, output, len / AES_BLOCK_SIZE);
+            break;
+        case NativeMode::None:
+            break;
+    }
+}
+
+void CipherContextPool::release() {
+    for (auto& ctx : contexts) {
+        EVP_CIPHER_CTX_free(ctx);
+        ctx = nullptr;
+    }
+    // the pool's own copy of the native kernel's key schedule
+    OPENSSL_cleanse(&round_keys, sizeof round_keys);
+}
+
+// Retained slabs, smallest first.
+struct ArenaState {
+    std::mutex mutex;
+    std::vector<BufferArena::Slab> slabs;
+    size_t retained = 0;
+};
+
+static ArenaState& arena() {
+    static ArenaState state;
+    return state;
+}
+
+BufferArena::Slab BufferArena::acquire(size_t size) {
+    size = std::max<size_t>(1, (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE) * HUGE_PAGE_SIZE;
+    {
+        // the smallest retained slab that fits, unless it would waste more
+        // than the request itself
+        ArenaState& state = arena();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        for (auto it = state.slabs.begin(); it != state.slabs.end(); ++it) {
+            if (it->size >= size && it->size / 2 <= size) {
+                Slab slab = *it;
+                slab.reused = true;
+                state.retained -= slab.size;
+                state.slabs.erase(it);
+                return slab;
+            }
+        }
+    }
+
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (data == MAP_FAILED) {
+        // no reserved huge pages: ask for transparent ones instead
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        madvise(data, size, MADV_HUGEPAGE);
+    }
+    return {static_cast<unsigned char*>(data), size, false};
+}
+
+void BufferArena::release(const Slab& slab) {
+    if (!slab.data) {
+        return;
+    }
+    ArenaState& state = arena();
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        if (state.retained + slab.size > ARENA_RETAINED_BYTES) {
+            munmap(slab.data, slab.size);
+            return;
+        }
+        // reserve the room now so the wipe can run without the lock
+        state.retained += slab.size;
+    }
+
+    // the slab held some job's key material or plaintext, and the next job
+    // to get it may be another client's
+    OPENSSL_cleanse(slab.data, slab.size);
+
+    std::lock_guard<std::mutex> lock(state.mutex);
+    auto it = std::lower_bound(state.slabs.begin(), state.slabs.end(), slab,
+                               [](const Slab& a, const Slab& b) { return a.size < b.size; });
+    state.slabs.insert(it, slab);
+}
+
+void BufferArena::trim() {
+    ArenaState& state = arena();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    for (const Slab& slab : state.slabs) {
+        munmap(slab.data, slab.size);
+    }
+    state.slabs.clear();
+    state.retained = 0;
+}
+
+size_t BufferArena::retained_bytes() {
+    ArenaState& state = arena();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    return state.retained;
+}
+
+PoolBuffer::PoolBuffer(int threads) : threads(threads > 0 ? threads : omp_get_max_threads()) {}
+
+PoolBuffer::~PoolBuffer() {
+    BufferArena::release(slab);
+}
+
+void PoolBuffer::resize(size_t size, size_t pool_len) {
+    length = size;
+    if (size <= slab.size) {
+        return;
+    }
+
+    BufferArena::release(slab);
+    slab = {nullptr, 0, false};
+    slab = BufferArena::acquire(size);
+    if (slab.reused) {
+        return;
+    }
+
+    // a fresh mapping has no pages yet: the first write places each one
+    pool_len = std::min(pool_len, size);
+    unsigned char* pages = slab.data;
+    const size_t page_size = 4096;
+
+    #pragma omp parallel num_threads(threads) proc_bind(spread)
+    {
+        Range range = partition_range(pool_len, omp_get_num_threads(), omp_get_thread_num(), THREAD_ALIGNMENT);
+        for (size_t i = range.begin; i < range.end; i += page_size) {
+            pages[i] = 0;
+        }
+    }
+}
+
+unsigned char* PoolBuffer::data() {
+    return slab.data;
+}
+
+size_t PoolBuffer::size() const {
+    return length;
+}
+
+void put_le(unsigned char* out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out[i] = static_cast<unsigned char>(value >> (8 * i));
+    }
+}
+
+uint64_t get_le(const unsigned char* in, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+uint64_t SegmentedContainer::segment_count(uint64_t size, uint64_t segment_size) {
+    return size == 0 ? 1 : (size + segment_size - 1) / segment_size;
+}
+
+size_t SegmentedContainer::header_size() const {
+    return gcm ? GCM_HEADER_SIZE : HEADER_SIZE;
+}
+
+size_t SegmentedContainer::entry_size() const {
+    return gcm ? GCM_TAG_SIZE : ENTRY_SIZE;
+}
+
+size_t SegmentedContainer::data_offset() const {
+    return gcm ? GCM_HEADER_SIZE : HEADER_SIZE + segments.size() * ENTRY_SIZE;
+}
+
+size_t SegmentedContainer::trailer_size() const {
+    return gcm ? segment_count(plaintext_size, segment_size) * GCM_TAG_SIZE : 0;
+}
+
+void SegmentedContainer::serialize_entries(const SegmentEntry* entries, size_t count, unsigned char* out) const {
+    for (size_t i = 0; i < count; i++, out += entry_size()) {
+        if (gcm) {
+            std::copy(entries[i].tag, entries[i].tag + GCM_TAG_SIZE, out);
+            continue;
+        }
+        std::copy(entries[i].iv, entries[i].iv + AES_BLOCK_SIZE, out);
+        put_le(out + 16, entries[i].offset, 8);
+        put_le(out + 24, entries[i].length, 8);
+    }
+}
+
+void SegmentedContainer::parse_entries(const unsigned char* in, size_t count, SegmentEntry* entries) const {
+    for (size_t i = 0; i < count; i++, in += entry_size()) {
+        SegmentEntry& entry = entries[i];
+        entry = SegmentEntry{};
+        if (gcm) {
+            std::copy(in, in + GCM_TAG_SIZE, entry.tag);
+            continue;
+        }
+        std::copy(in, in + AES_BLOCK_SIZE, entry.iv);
+        entry.offset = get_le(in + 16, 8);
+        entry.length = get_le(in + 24, 8);
+    }
+}
+
+std::vector<unsigned char> SegmentedContainer::serialize_header() const {
+    std::vector<unsigned char> out(header_size(), 0);
+    std::memcpy(out.data(), gcm ? "PGCM" : "PCBC", 4);
+    put_le(out.data() + 4, VERSION, 2);
+    put_le(out.data() + 8, segment_size, 4);
+    put_le(out.data() + 16, segment_count(plaintext_size, segment_size), 8);
+    put_le(out.data() + 24, plaintext_size, 8);
+    if (gcm) {
+        std::copy(nonce_prefix, nonce_prefix + NONCE_PREFIX_SIZE, out.data() + HEADER_SIZE);
+    }
+    return out;
+}
+
+std::vector<unsigned char> SegmentedContainer::serialize() const {
+    std::vector<unsigned char> out = serialize_header();
+    if (!gcm) {
+        out.resize(data_offset());
+        serialize_entries(segments.data(), segments.size(), out.data() + HEADER_SIZE);
+    }
+    return out;
+}
+
+std::vector<unsigned char> SegmentedContainer::serialize_trailer() const {
+    std::vector<unsigned char> out;
+    if (gcm) {
+        out.resize(segments.size() * GCM_TAG_SIZE);
+        serialize_entries(segments.data(), segments.size(), out.data());
+    }
+    return out;
+}
+
+void SegmentedContainer::segment_nonce(uint64_t index, unsigned char nonce[GCM_NONCE_SIZE]) const {
+    std::copy(nonce_prefix, nonce_prefix + NONCE_PREFIX_SIZE, nonce);
+    for (int i = 0; i < 4; i++) {
+        nonce[NONCE_PREFIX_SIZE + i] = static_cast<unsigned char>(index >> (24 - 8 * i));
+    }
+}
+
+bool SegmentedContainer::parse(const unsigned char* data, size_t available, size_t file_size) {
+    size_t header_len = header_size();
+    if (available < header_len || std::memcmp(data, gcm ? "PGCM" : "PCBC", 4) != 0 ||
+        get_le(data + 4, 2) != VERSION) {
+        return false;
+    }
+    segment_size = get_le(data + 8, 4);
+    uint64_t count = get_le(data + 16, 8);
+    plaintext_size = get_le(data + 24, 8);
+    if (segment_size == 0 || segment_size % AES_BLOCK_SIZE != 0 ||
+        count != segment_count(plaintext_size, segment_size) ||
+        count > (available - header_len) / entry_size()) {
+        return false;
+    }
+
+    segments.resize(count);
+    parse_entries(data + header_len, count, segments.data());
+    if (gcm) {
+        std::copy(data + HEADER_SIZE, data + GCM_HEADER_SIZE, nonce_prefix);
+        for (uint64_t i = 0; i < count; i++) {
+            segments[i].offset = i * segment_size;
+            segments[i].length = std::min<uint64_t>(segment_size, plaintext_size - i * segment_size);
+        }
+        // the segment index has to fit the nonce
+        return count - 1 <= UINT32_MAX && header_len + plaintext_size + trailer_size() == file_size;
+    }
+
+    uint64_t expected_offset = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        const SegmentEntry& segment = segments[i];
+        uint64_t plain = (i + 1 < count) ? segment_size : plaintext_size - i * segment_size;
+        uint64_t expected_length = (i + 1 < count) ? plain : (plain / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE;
+        if (segment.offset != expected_offset || segment.length != expected_length) {
+            return false;
+        }
+        expected_offset += segment.length;
+    }
+    return data_offset() + expected_offset == file_size;
+}
+
+const EVP_CIPHER* StreamTransformer::cipher_type(const std::string& mode) {
+    if (mode == "aes-128-ecb") {
+        return EVP_aes_128_ecb();
+    }
+    if (mode == "aes-128-ctr") {
+        return EVP_aes_128_ctr();
+    }
+    if (mode == "aes-128-gcm") {
+        return EVP_aes_128_gcm();
+    }
+    return EVP_aes_128_cbc();
+}
+
+StreamTransformer::StreamTransformer(AESCipher& cipher, const std::string& operation, const std::string& mode,
+                                     const SegmentedContainer& container, int threads)
+    : cipher(cipher), encrypt(operation == "encrypt"), mode(mode), container(container),
+      pool(cipher_type(mode), cipher, operation == "encrypt", threads) {}
+
+void StreamTransformer::record_spans(ThreadSpans* spans) {
+    pool.record_spans(spans);
+}
+
+long long StreamTransformer::transform(const unsigned char* input, size_t len, uint64_t offset, bool stream_end,
+                                       const unsigned char* previous_block, unsigned char* output,
+                                       std::vector<SegmentEntry>& entries) {
+    if (mode == "aes-128-cbc-seg" || mode == "aes-128-gcm") {
+        return encrypt ? encrypt_segments(input, len, offset, stream_end, output, entries)
+                       : decrypt_segments(input, len, offset, stream_end, output);
+    }
+
+    if (mode == "aes-128-ctr") {
+        // CTR is its own inverse and needs no padding: the counter comes
+        // straight from the global block offset past the stream's IV
+        long long processed_len = pool.update_counter(input, output, len, cipher.get_iv(), offset / AES_BLOCK_SIZE);
+        if (processed_len < 0) {
+            throw std::runtime_error("Encryption failed in AES-CTR mode.");
+        }
+        return processed_len;
+    }
+
+    if (encrypt && mode == "aes-128-cbc") {
+        // CBC is one stream: the piece continues from `previous_block`, and
+        // only the end of the stream is padded
+        long long processed_len = cipher.encrypt_aes_cbc(input, len, output, previous_block, stream_end);
+        if (processed_len < 0) {
+            throw std::runtime_error("Encryption failed in AES-CBC mode.");
+        }
+        return processed_len;
+    }
+
+    if (encrypt) {
+        size_t num_blocks = len / AES_BLOCK_SIZE;
+        long long processed_len = pool.update_blocks(input, output, num_blocks);
+
+        // the padding block is produced exactly once, at the end of the stream
+        if (processed_len >= 0 && stream_end) {
+            long long final_len = cipher.encrypt_aes_ecb(input + num_blocks * AES_BLOCK_SIZE, len % AES_BLOCK_SIZE,
+                                                   output + num_blocks * AES_BLOCK_SIZE);
+            processed_len = final_len < 0 ? -1 : processed_len + final_len;
+        }
+        if (processed_len < 0) {
+            throw std::runtime_error("Encryption failed in AES-ECB mode.");
+        }
+        return processed_len;
+    }
+
+    if (len % AES_BLOCK_SIZE != 0 || (stream_end && len == 0)) {
+        throw std::runtime_error("Ciphertext length is not a multiple of the AES block size.");
+    }
+
+    if (mode == "aes-128-cbc") {
+        long long processed_len = pool.update_chained(input, output, len, previous_block);
+
+        // the padding sits at the global end of the stream
+        if (processed_len >= 0 && stream_end) {
+            int pad = pkcs7_padding_length(output + len - AES_BLOCK_SIZE);
+            processed_len = pad < 0 ? -1 : processed_len - pad;
+        }
+        if (processed_len < 0) {
+            throw std::runtime_error("Decryption failed in AES-CBC mode.");
+        }
+        return processed_len;
+    }
+
+    // the end of the stream keeps its final block back to strip the padding
+    size_t num_blocks = len / AES_BLOCK_SIZE - (stream_end ? 1 : 0);
+    long long processed_len = pool.update_blocks(input, output, num_blocks);
+    if (processed_len >= 0 && stream_end) {
+        long long final_len = cipher.decrypt_aes_ecb(input + num_blocks * AES_BLOCK_SIZE, AES_BLOCK_SIZE,
+                                               output + num_blocks * AES_BLOCK_SIZE);
+        processed_len = final_len < 0 ? -1 : processed_len + final_len;
+    }
+    if (processed_len < 0) {
+        throw std::runtime_error("Decryption failed in AES-ECB mode.");
+    }
+    return processed_len;
+}
+
+long long StreamTransformer::encrypt_segments(const unsigned char* input, size_t len, uint64_t offset, bool stream_end,
+                                              unsigned char* output, std::vector<SegmentEntry>& entries) {
+    // whole segments per piece; the end of the stream also owns the padded tail
+    size_t count = stream_end ? SegmentedContainer::segment_count(len, SEGMENT_SIZE) : len / SEGMENT_SIZE;
+    uint64_t first_segment = offset / SEGMENT_SIZE;
+    size_t first_entry = entries.size();
+    entries.resize(first_entry + count);
+    SegmentEntry* my_entries = entries.data() + first_entry;
+
+    // GCM segments take their nonce from the segment index instead
+    for (size_t i = 0; i < count && !container.gcm; i++) {
+        if (RAND_bytes(my_entries[i].iv, AES_BLOCK_SIZE) != 1) {
+            throw std::runtime_error("Failed to generate segment IV.");
+        }
+    }
+    std::vector<unsigned char> aad = container.serialize_header();
+
+    long long processed_len = len;
+    bool failed = false;
+
+    #pragma omp parallel for schedule(static) num_threads(pool.thread_count()) proc_bind(spread)
+    for (long long i = 0; i < static_cast<long long>(count); i++) {
+        size_t begin = i * SEGMENT_SIZE;
+        size_t segment_len = std::min(SEGMENT_SIZE, len - begin);
+        SegmentEntry& entry = my_entries[i];
+        entry.offset = (first_segment + i) * SEGMENT_SIZE;
+
+        bool ok;
+        if (container.gcm) {
+            unsigned char nonce[GCM_NONCE_SIZE];
+            container.segment_nonce(first_segment + i, nonce);
+            ok = pool.transform_aead(omp_get_thread_num(), nonce, aad.data(), aad.size(), input + begin,
+                                     output + begin, segment_len, entry.tag);
+            entry.length = segment_len;
+        } else if (stream_end && i + 1 == static_cast<long long>(count)) {
+            long long final_len = cipher.encrypt_aes_cbc(input + begin, segment_len, output + begin, entry.iv, true);
+            ok = final_len >= 0;
+            entry.length = final_len;
+            processed_len = begin + final_len;
+        } else {
+            ok = pool.transform(omp_get_thread_num(), entry.iv, input + begin, output + begin, segment_len);
+            entry.length = segment_len;
+        }
+        if (!ok) {
+            #pragma omp atomic write
+            failed = true;
+        }
+    }
+    if (failed) {
+        throw std::runtime_error(container.gcm ? "Encryption failed in AES-GCM mode."
+                                               : "Encryption failed in segmented AES-CBC mode.");
+    }
+    return processed_len;
+}
+
+long long StreamTransformer::decrypt_segments(const unsigned char* input, size_t len, uint64_t offset, bool stream_end,
+                                              unsigned char* output) {
+    // segments are self-contained: each thread decrypts whole ones with the
+    // IV from the table, whatever rank count produced the file
+    uint64_t first_segment = offset / container.segment_size;
+    uint64_t end_segment = stream_end ? container.segments.size() : (offset + len) / container.segment_size;
+    std::vector<unsigned char> aad = container.serialize_header();
+    long long bad_segment = -1;
+
+    #pragma omp parallel for schedule(static) num_threads(pool.thread_count()) proc_bind(spread)
+    for (long long i = first_segment; i < static_cast<long long>(end_segment); i++) {
+        const SegmentEntry& entry = container.segments[i];
+        size_t begin = entry.offset - offset;
+        bool ok;
+        if (container.gcm) {
+            unsigned char nonce[GCM_NONCE_SIZE];
+            unsigned char tag[GCM_TAG_SIZE];
+            container.segment_nonce(i, nonce);
+            std::copy(entry.tag, entry.tag + GCM_TAG_SIZE, tag);
+            ok = pool.transform_aead(omp_get_thread_num(), nonce, aad.data(), aad.size(), input + begin,
+                                     output + begin, entry.length, tag);
+        } else {
+            ok = pool.transform(omp_get_thread_num(), entry.iv, input + begin, output + begin, entry.length);
+        }
+        if (!ok) {
+            #pragma omp atomic write
+            bad_segment = i;
+        }
+    }
+
+    if (container.gcm) {
+        if (bad_segment >= 0) {
+            // nothing of a piece that failed authentication is handed out
+            OPENSSL_cleanse(output, len);
+            throw std::runtime_error("Authentication failed for segment " + std::to_string(bad_segment) +
+                                     " in AES-GCM mode.");
+        }
+        return len;
+    }
+
+    bool failed = bad_segment >= 0;
+    long long processed_len = len;
+    if (!failed && stream_end) {
+        int pad = pkcs7_padding_length(output + len - AES_BLOCK_SIZE);
+        failed = pad < 0;
+        processed_len -= pad;
+    }
+    if (failed) {
+        throw std::runtime_error("Decryption failed in segmented AES-CBC mode.");
+    }
+    return processed_len;
+}
+
+AESCryptEngine::AESCryptEngine(const std::string& key, const std::string& operation, const std::string& mode,
+                               int threads)
+    : cipher(key), encrypt(operation == "encrypt"), mode(mode),
+      transformer(cipher, operation, mode, container, threads) {
+    if (operation != "encrypt" && operation != "decrypt") {
+        throw std::invalid_argument("Invalid operation. Use 'encrypt' or 'decrypt'.");
+    }
+    if (mode != "aes-128-cbc" && mode != "aes-128-ecb" && mode != "aes-128-ctr" && mode != "aes-128-cbc-seg" &&
+        mode != "aes-128-gcm") {
+        throw std::invalid_argument(
+            "Invalid mode. Use 'aes-128-cbc', 'aes-128-ecb', 'aes-128-ctr', 'aes-128-cbc-seg' or 'aes-128-gcm'.");
+    }
+    container.gcm = mode == "aes-128-gcm";
+}
+
+size_t AESCryptEngine::output_bound(size_t len) const {
+    if (!encrypt) {
+        return len;
+    }
+    size_t layout_len = 0;
+    if (mode == "aes-128-ctr") {
+        layout_len = CTR_HEADER_SIZE;
+    } else if (mode == "aes-128-cbc-seg") {
+        layout_len = SegmentedContainer::HEADER_SIZE
+            + SegmentedContainer::segment_count(len, SEGMENT_SIZE) * SegmentedContainer::ENTRY_SIZE;
+    } else if (mode == "aes-128-gcm") {
+        layout_len = SegmentedContainer::GCM_HEADER_SIZE
+            + SegmentedContainer::segment_count(len, SEGMENT_SIZE) * GCM_TAG_SIZE;
+    }
+    return layout_len + len + AES_BLOCK_SIZE;
+}
+
+long long AESCryptEngine::process(const unsigned char* input, size_t len, unsigned char* output,
+                                  size_t output_capacity) {
+    if (output_capacity < output_bound(len)) {
+        return -1;
+    }
+
+    // the whole buffer is one stream: a single piece at offset 0 that also
+    // ends the stream
+    std::vector<SegmentEntry> entries;
+    try {
+        if (mode == "aes-128-ctr") {
+            // a fresh counter block for every stream, stored in front of it
+            if (encrypt) {
+                unsigned char iv[AES_BLOCK_SIZE];
+                if (RAND_bytes(iv, AES_BLOCK_SIZE) != 1) {
+                    return -1;
+                }
+                cipher.set_iv(iv);
+                std::copy(iv, iv + AES_BLOCK_SIZE, output);
+                return CTR_HEADER_SIZE + transformer.transform(input, len, 0, true, nullptr,
+                                                               output + CTR_HEADER_SIZE, entries);
+            }
+            if (len < CTR_HEADER_SIZE) {
+                return -1;
+            }
+            cipher.set_iv(input);
+            return transformer.transform(input + CTR_HEADER_SIZE, len - CTR_HEADER_SIZE, 0, true, nullptr, output,
+                                         entries);
+        }
+        if (mode != "aes-128-cbc-seg" && mode != "aes-128-gcm") {
+            return transformer.transform(input, len, 0, true, cipher.get_iv(), output, entries);
+        }
+
+        if (encrypt) {
+            // the GCM header is authenticated with every segment, so it is
+            // settled first; the CBC table is only known once the segments
+            // are encrypted
+            container.plaintext_size = len;
+            if (container.gcm && RAND_bytes(container.nonce_prefix, SegmentedContainer::NONCE_PREFIX_SIZE) != 1) {
+                return -1;
+            }
+            size_t layout_len = container.gcm ? SegmentedContainer::GCM_HEADER_SIZE
+                                              : output_bound(len) - len - AES_BLOCK_SIZE;
+            long long data_len = transformer.transform(input, len, 0, true, nullptr, output + layout_len, entries);
+            container.segments = entries;
+            std::vector<unsigned char> layout = container.serialize();
+            std::vector<unsigned char> trailer = container.serialize_trailer();
+            std::copy(layout.begin(), layout.end(), output);
+            std::copy(trailer.begin(), trailer.end(), output + layout_len + data_len);
+            return layout_len + data_len + trailer.size();
+        }
+
+        std::vector<unsigned char> layout = container.read_layout([&](size_t offset, unsigned char* out, size_t n) {
+            std::copy(input + offset, input + offset + n, out);
+        }, len);
+        if (!container.parse(layout.data(), layout.size(), len)) {
+            return -1;
+        }
+        size_t data_offset = container.data_offset();
+        return transformer.transform(input + data_offset, len - data_offset - container.trailer_size(), 0, true,
+                                     nullptr, output, entries);
+    } catch (const std::exception&) {
+        return -1;
+    }
+}
@@ -0,0 +1,491 @@
+// aescrypt: the AES engine behind executable_mpi, free of any MPI code. Ranks
+// feed it pieces of a distributed stream through StreamTransformer; anything
+// else can hand AESCryptEngine a whole buffer and a buffer for the result.
+#ifndef AESCRYPT_H
+#define AESCRYPT_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <openssl/evp.h>
+#include <openssl/aes.h>
+
+#include "aesni.h"
+
+// Thread ranges are whole cache lines, so every worker runs full-block bulk
+// updates and nothing straddles an AES block.
+constexpr size_t THREAD_ALIGNMENT = 64;
+
+// OpenSSL counts bytes in int, so cipher updates are fed in chunks of at most
+// MAX_UPDATE_SIZE whatever the buffer size.
+constexpr size_t MAX_UPDATE_SIZE = 1 << 30;
+
+struct Range {
+    size_t begin;
+    size_t end;
+
+    size_t size() const {
+        return end - begin;
+    }
+};
+
+// Splits [0, total) into `parts` contiguous ranges whose boundaries are
+// multiples of `alignment`. Only the last range can end off-alignment, so it
+// is the one that carries the tail of the stream (and its padding).
+Range partition_range(size_t total, size_t parts, size_t index, size_t alignment);
+
+// Length of the PKCS#7 padding that ends `block`, or -1 if it is malformed.
+int pkcs7_padding_length(const unsigned char* block);
+
+// Adds `blocks` to a 128-bit big-endian counter block, the way CTR mode
+// increments it, so a worker can jump straight to its first block.
+void advance_counter(unsigned char counter[AES_BLOCK_SIZE], uint64_t blocks);
+
+// Parses sizes such as "65536", "512K", "64M" or "2G".
+size_t parse_size(const std::string& text);
+
+// EVP_CipherUpdate over a buffer of any length. The chunks are whole blocks,
+// so the context carries the chain from one to the next. Adds the bytes
+// written to `output_len`.
+bool cipher_update(EVP_CIPHER_CTX* ctx, unsigned char* output, long long& output_len,
+                   const unsigned char* input, size_t len);
+
+// Everything derived from one AES-128 key: an EVP context per cipher and
+// direction, keyed on first use, and the round keys of each native kernel.
+// The contexts are templates that are only ever copied, so their users set
+// an IV instead of expanding the key again.
+class KeySchedule {
+private:
+    struct Context {
+        const EVP_CIPHER* type;
+        bool encrypt;
+        EVP_CIPHER_CTX* ctx;
+    };
+
+    struct NativeKeys {
+        AesKernel kernel;
+        std::unique_ptr<AesRoundKeys> keys;
+    };
+
+    unsigned char key[16];
+    std::mutex mutex;
+    std::vector<Context> contexts;
+    std::vector<NativeKeys> native_keys;
+
+public:
+    explicit KeySchedule(const unsigned char* key);
+
+    ~KeySchedule();
+
+    KeySchedule(const KeySchedule&) = delete;
+    KeySchedule& operator=(const KeySchedule&) = delete;
+
+    bool matches(const unsigned char* key) const;
+
+    // The keyed template for `type`, or nullptr if it cannot be keyed.
+    const EVP_CIPHER_CTX* context(const EVP_CIPHER* type, bool encrypt);
+
+    const AesRoundKeys& round_keys(AesKernel kernel);
+};
+
+// Process-wide least-recently-used cache of key schedules, so the jobs of a
+// daemon or batch run that share a key skip key expansion altogether. Holds
+// KEY_CACHE_CAPACITY keys unless set_capacity() says otherwise (0 disables it).
+constexpr size_t KEY_CACHE_CAPACITY = 16;
+
+class KeyCache {
+public:
+    static std::shared_ptr<KeySchedule> get(const unsigned char* key);
+
+    static void set_capacity(size_t capacity);
+
+    static size_t size();
+};
+
+// AES-128 with one key. The methods work on a per-thread scratch context that
+// is reset and refilled from the cached key schedule, so a call costs a
+// context copy and an IV instead of a new context and a key expansion, and
+// any thread may call them.
+class AESCipher {
+private:
+    unsigned char key[16];
+    unsigned char iv[16];
+    std::shared_ptr<KeySchedule> schedule;
+
+    // The calling thread's scratch context holding a fresh copy of the keyed
+    // `type` context, seeded with `iv`. nullptr on failure.
+    EVP_CIPHER_CTX* prepare(const EVP_CIPHER* type, bool encrypt, const unsigned char* iv, bool padding) const;
+
+public:
+    AESCipher(const std::string& key_str);
+
+    const unsigned char* get_key() const;
+
+    const unsigned char* get_iv() const;
+
+    // Replaces the IV, zero unless set: the default CBC chain start and the
+    // initial counter block of CTR.
+    void set_iv(const unsigned char* iv);
+
+    // A new context of `type` already keyed with this key, e.g. one per
+    // thread. The caller sets the IV and frees it. nullptr on failure.
+    EVP_CIPHER_CTX* clone_context(const EVP_CIPHER* type, bool encrypt) const;
+
+    const AesRoundKeys& round_keys(AesKernel kernel) const;
+
+    // chain_iv continues a stream started by another rank (its last ciphertext
+    // block); padding is only wanted at the global end of the stream.
+    long long encrypt_aes_cbc(const unsigned char* plaintext, size_t plaintext_len,
+        unsigned char* ciphertext, const unsigned char* chain_iv = nullptr, bool padding = true
+    );
+
+    long long encrypt_aes_ecb(const unsigned char* plaintext, size_t plaintext_len,
+                        unsigned char* ciphertext);
+
+    long long decrypt_aes_cbc(const unsigned char* ciphertext, size_t ciphertext_len,
+                        unsigned char* plaintext, const unsigned char* chain_iv = nullptr, bool padding = true);
+
+    long long decrypt_aes_ecb(const unsigned char* ciphertext, size_t ciphertext_len,
+                        unsigned char* plaintext);
+};
+
+// Wall-clock spans (omp_get_wtime) of the bulk work done by each OpenMP
+// thread, for tracing. Every thread appends to its own list, so recording
+// takes no lock.
+class ThreadSpans {
+public:
+    struct Span {
+        double begin;
+        double end;
+        size_t bytes;
+    };
+
+    explicit ThreadSpans(int threads);
+
+    void add(int thread, double begin, double end, size_t bytes);
+
+    int thread_count() const;
+
+    const std::vector<Span>& of(int thread) const;
+
+private:
+    std::vector<std::vector<Span>> spans;
+};
+
+// One EVP context per OpenMP thread, cloned from the cipher's key schedule so
+// the parallel loops only pay for EVP_CipherUpdate instead of a new/init/free
+// per block. The parallel loops run `threads` threads (0 for
+// omp_get_max_threads()). ECB, CTR and CBC decryption go through the native
+// kernel when the CPU has one.
+class CipherContextPool {
+private:
+    enum class NativeMode {
+        None,
+        Ecb,
+        Ctr,
+        CbcDecrypt,
+    };
+
+    std::vector<EVP_CIPHER_CTX*> contexts;
+    bool encrypt;
+    NativeMode native = NativeMode::None;
+    AesKernel kernel = AesKernel::Evp;
+    AesRoundKeys round_keys;
+    ThreadSpans* spans = nullptr;
+
+public:
+    CipherContextPool(const EVP_CIPHER* type, const AESCipher& cipher, bool encrypt, int threads = 0);
+
+    ~CipherContextPool();
+
+    CipherContextPool(const CipherContextPool&) = delete;
+    CipherContextPool& operator=(const CipherContextPool&) = delete;
+
+    int thread_count() const;
+
+    AesKernel get_kernel() const;
+
+    // Records every transform and update_blocks range in `spans` from now on
+    // (nullptr stops recording).
+    void record_spans(ThreadSpans* spans);
+
+    // Re-seeds the calling thread's context with `iv` (key schedule untouched)
+    // and transforms one block-aligned span. Returns false on failure.
+    bool transform(int thread, const unsigned char* iv, const unsigned char* input,
+                   unsigned char* output, size_t len);
+
+    // Each thread takes one contiguous range of blocks and transforms it with a
+    // single update call. Returns the number of bytes written or -1 on failure.
+    long long update_blocks(const unsigned char* input, unsigned char* output, size_t num_blocks);
+
+    // CTR keystream for bytes [first_block * 16, first_block * 16 + len) of the
+    // stream. Every thread re-seeds its context with the counter of its own
+    // first block, so ranks and threads never depend on one another.
+    long long update_counter(const unsigned char* input, unsigned char* output, size_t len,
+                             const unsigned char* base_iv, uint64_t first_block);
+
+    // CBC decryption of a block-aligned range. Each thread's IV is simply the
+    // ciphertext block in front of its range; the first thread uses
+    // `previous_block`, which belongs to the left neighbour. Output may be the
+    // input buffer.
+    long long update_chained(const unsigned char* input, unsigned char* output, size_t len,
+                             const unsigned char* previous_block);
+
+    // Seals (or opens) one AES-GCM message on the calling thread's context,
+    // which the pool keyed for GCM. `aad` is authenticated but not encrypted;
+    // `tag` receives the tag when encrypting and is checked when decrypting.
+    // Returns false on failure, a tag mismatch included.
+    bool transform_aead(int thread, const unsigned char* nonce, const unsigned char* aad, size_t aad_len,
+                        const unsigned char* input, unsigned char* output, size_t len, unsigned char* tag);
+
+private:
+    // The native kernel's version of one EVP update from `iv`.
+    void native_update(const unsigned char* iv, const unsigned char* input, unsigned char* output, size_t len) const;
+
+    void release();
+};
+
+// Process-wide store of large buffers ("slabs") for PoolBuffer. Slabs are
+// mapped in whole HUGE_PAGE_SIZE units, on reserved huge pages when the
+// system has them and as transparent huge pages otherwise, and are not
+// zero-filled by acquire(). Released slabs are kept for the next job up to
+// ARENA_RETAINED_BYTES, so the jobs of a daemon or batch run reuse memory
+// whose pages are already faulted in. A slab is wiped with OPENSSL_cleanse
+// before it is retained, so no job sees the data of the one before it.
+constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+constexpr size_t ARENA_RETAINED_BYTES = size_t(1) << 30;
+
+class BufferArena {
+public:
+    struct Slab {
+        unsigned char* data;
+        size_t size;
+        // false for a freshly mapped slab, whose pages nobody has touched yet
+        bool reused;
+    };
+
+    // A slab of at least `size` bytes, or throws std::bad_alloc.
+    static Slab acquire(size_t size);
+
+    static void release(const Slab& slab);
+
+    // Unmaps every retained slab.
+    static void trim();
+
+    static size_t retained_bytes();
+};
+
+// Byte buffer for data that a CipherContextPool of `threads` threads will
+// process, carved from the BufferArena. Unlike std::vector, growing it does
+// not zero-fill the memory from the calling thread: each OpenMP thread first
+// touches the range it gets in the pool's loops, so on a NUMA host with pinned
+// threads every page lands on the node of the thread that encrypts it.
+// Growing does not keep the contents.
+class PoolBuffer {
+private:
+    BufferArena::Slab slab = {nullptr, 0, false};
+    size_t length = 0;
+    int threads;
+
+public:
+    explicit PoolBuffer(int threads = 0);
+
+    ~PoolBuffer();
+
+    PoolBuffer(const PoolBuffer&) = delete;
+    PoolBuffer& operator=(const PoolBuffer&) = delete;
+
+    // Only the first `pool_len` bytes are spread over the threads; the rest
+    // is left to whoever writes it first.
+    void resize(size_t size, size_t pool_len = SIZE_MAX);
+
+    unsigned char* data();
+
+    size_t size() const;
+};
+
+// "aes-128-ctr" output starts with the stream's initial counter block, drawn
+// at random for every file so no two files share a keystream, followed by the
+// ciphertext: what `openssl enc -aes-128-ctr -iv <that block>` produces.
+constexpr size_t CTR_HEADER_SIZE = AES_BLOCK_SIZE;
+
+// Segmented CBC container written by "aes-128-cbc-seg". The plaintext is cut
+// into fixed-size segments that are CBC-encrypted independently under their
+// own random IV, so encryption parallelizes as well as decryption and the
+// file decrypts with any number of ranks. Only the last segment is padded.
+//
+//   header  "PCBC", u16 version, u16 reserved, u32 segment size,
+//           u32 reserved, u64 segment count, u64 plaintext size
+//   table   per segment: 16-byte IV, u64 data offset, u64 ciphertext length
+//   data    segment ciphertexts back to back
+//
+// "aes-128-gcm" writes the same segments as independent AES-GCM messages,
+// so every segment is authenticated on its own and in parallel:
+//
+//   header  "PGCM", u16 version, u16 reserved, u32 segment size,
+//           u32 reserved, u64 segment count, u64 plaintext size,
+//           8-byte random nonce prefix
+//   data    segment ciphertexts back to back, as long as the plaintext
+//   trailer 16-byte tag per segment
+//
+// Segment i is sealed under the nonce prefix followed by i as a big-endian
+// u32, with the whole header as additional data, so a segment cannot be
+// altered, reordered, dropped or moved to another file without failing
+// verification. Integers are little-endian.
+constexpr size_t SEGMENT_SIZE = 1 << 20;
+
+constexpr size_t GCM_NONCE_SIZE = 12;
+constexpr size_t GCM_TAG_SIZE = 16;
+
+struct SegmentEntry {
+    unsigned char iv[AES_BLOCK_SIZE];
+    uint64_t offset;
+    uint64_t length;
+    unsigned char tag[GCM_TAG_SIZE];
+};
+
+void put_le(unsigned char* out, uint64_t value, int bytes);
+
+uint64_t get_le(const unsigned char* in, int bytes);
+
+class SegmentedContainer {
+public:
+    static constexpr size_t HEADER_SIZE = 32;
+    static constexpr size_t ENTRY_SIZE = 32;
+    static constexpr size_t GCM_HEADER_SIZE = 40;
+    static constexpr size_t NONCE_PREFIX_SIZE = 8;
+    static constexpr uint16_t VERSION = 1;
+
+    bool gcm = false;
+    uint32_t segment_size = SEGMENT_SIZE;
+    uint64_t plaintext_size = 0;
+    unsigned char nonce_prefix[NONCE_PREFIX_SIZE] = {};
+    std::vector<SegmentEntry> segments;
+
+    static uint64_t segment_count(uint64_t size, uint64_t segment_size);
+
+    size_t header_size() const;
+
+    // Bytes per segment in the table (CBC) or the trailer (GCM, the tag).
+    size_t entry_size() const;
+
+    // Where the segment data starts, and the bytes that follow it.
+    size_t data_offset() const;
+
+    size_t trailer_size() const;
+
+    // The entries as stored in the file. GCM entries keep only their tag.
+    void serialize_entries(const SegmentEntry* entries, size_t count, unsigned char* out) const;
+
+    void parse_entries(const unsigned char* in, size_t count, SegmentEntry* entries) const;
+
+    // Just the header, which is also the additional data of every GCM segment.
+    std::vector<unsigned char> serialize_header() const;
+
+    // Everything in front of the data: the header and, for CBC, the table.
+    std::vector<unsigned char> serialize() const;
+
+    // Everything behind the data: the GCM tags.
+    std::vector<unsigned char> serialize_trailer() const;
+
+    // The nonce of GCM segment `index`.
+    void segment_nonce(uint64_t index, unsigned char nonce[GCM_NONCE_SIZE]) const;
+
+    // Fetches the bytes parse() needs, the header followed by the table or the
+    // tags, and never the segment data. `read_at(offset, out, len)` reads from
+    // wherever the file is.
+    template <typename Reader>
+    std::vector<unsigned char> read_layout(Reader read_at, size_t file_size) const;
+
+    // Reads the header followed by the table or trailer (the first
+    // `available` bytes of `data`) of a container that is `file_size` bytes
+    // long. Returns false unless the layout is exactly the one serialize()
+    // and the encrypt path produce.
+    bool parse(const unsigned char* data, size_t available, size_t file_size);
+};
+
+template <typename Reader>
+std::vector<unsigned char> SegmentedContainer::read_layout(Reader read_at, size_t file_size) const {
+    size_t header_len = header_size();
+    std::vector<unsigned char> layout(std::min(file_size, header_len));
+    read_at(0, layout.data(), layout.size());
+
+    if (layout.size() == header_len) {
+        uint64_t count = std::min<uint64_t>(get_le(layout.data() + 16, 8), (file_size - header_len) / entry_size());
+        size_t entries_len = count * entry_size();
+        layout.resize(header_len + entries_len);
+        read_at(gcm ? file_size - entries_len : header_len, layout.data() + header_len, entries_len);
+    }
+    return layout;
+}
+
+// Transforms one rank's piece of the stream in the job's mode. The context
+// pool is keyed once and reused for every window of a streamed job.
+class StreamTransformer {
+private:
+    AESCipher& cipher;
+    bool encrypt;
+    std::string mode;
+    const SegmentedContainer& container;
+    CipherContextPool pool;
+
+    static const EVP_CIPHER* cipher_type(const std::string& mode);
+
+public:
+    StreamTransformer(AESCipher& cipher, const std::string& operation, const std::string& mode,
+                      const SegmentedContainer& container, int threads = 0);
+
+    void record_spans(ThreadSpans* spans);
+
+    // `offset` is where the piece starts in the stream and `stream_end` marks
+    // the piece that carries the padding. For CBC, `previous_block` is the
+    // ciphertext block in front of the piece. New segment table entries are
+    // appended to `entries`. Returns the number of output bytes. ECB, CTR and
+    // CBC decryption may run in place (output == input); ECB encryption then
+    // needs a spare block behind the input for the padding. When a GCM
+    // segment fails authentication the whole output is wiped before the
+    // error is thrown.
+    long long transform(const unsigned char* input, size_t len, uint64_t offset, bool stream_end,
+                        const unsigned char* previous_block, unsigned char* output,
+                        std::vector<SegmentEntry>& entries);
+
+private:
+    long long encrypt_segments(const unsigned char* input, size_t len, uint64_t offset, bool stream_end,
+                               unsigned char* output, std::vector<SegmentEntry>& entries);
+
+    long long decrypt_segments(const unsigned char* input, size_t len, uint64_t offset, bool stream_end,
+                               unsigned char* output);
+};
+
+// In-memory engine for embedding: each process() call is one complete stream,
+// transformed in the calling process with `threads` OpenMP threads (0 for the
+// OpenMP default). "aes-128-cbc-seg" and "aes-128-gcm" produce and consume
+// whole containers, header, segment table and tags included, and
+// "aes-128-ctr" its counter block prefix.
+class AESCryptEngine {
+private:
+    AESCipher cipher;
+    bool encrypt;
+    std::string mode;
+    SegmentedContainer container;
+    StreamTransformer transformer;
+
+public:
+    AESCryptEngine(const std::string& key, const std::string& operation, const std::string& mode, int threads = 0);
+
+    // Largest output process() can produce for `len` input bytes.
+    size_t output_bound(size_t len) const;
+
+    // Encrypts or decrypts `input` into `output`, which holds `output_capacity`
+    // bytes and must not overlap the input. Returns the number of bytes written,
+    // or -1 if the output is smaller than output_bound(len) or the input does
+    // not decrypt. A GCM stream that fails authentication leaves the output
+    // zeroed.
+    long long process(const unsigned char* input, size_t len, unsigned char* output, size_t output_capacity);
+};
+
+#endif
@@ -0,0 +1,469 @@
+#include "aesni.h"
+#include "aessoft.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AESCRYPT_X86 1
+#endif
+
+AesKernel detect_aes_kernel() {
+    AesKernel best = AesKernel::Soft;
+#ifdef AESCRYPT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("sse4.1")) {
+        best = AesKernel::AesNi;
+        if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx512f") &&
+            __builtin_cpu_supports("avx512bw")) {
+            best = AesKernel::Vaes;
+        }
+    }
+#endif
+
+    const char* requested = std::getenv("AESCRYPT_KERNEL");
+    if (requested && std::strcmp(requested, "evp") == 0) {
+        return AesKernel::Evp;
+    }
+    if (requested && std::strcmp(requested, "soft") == 0) {
+        return AesKernel::Soft;
+    }
+    if (requested && std::strcmp(requested, "aesni") == 0 && best == AesKernel::Vaes) {
+        return AesKernel::AesNi;
+    }
+    return best;
+}
+
+const char* aes_kernel_name(AesKernel kernel) {
+    switch (kernel) {
+        case AesKernel::Soft:
+            return "soft";
+        case AesKernel::AesNi:
+            return "aesni";
+        case AesKernel::Vaes:
+            return "vaes";
+        default:
+            return "evp";
+    }
+}
+
+#ifdef AESCRYPT_X86
+
+// Only these functions are built for AES-NI/VAES, so the rest of the library
+// still runs on any x86-64 CPU.
+#define AESNI_TARGET __attribute__((target("aes,sse4.1")))
+#define VAES_TARGET __attribute__((target("aes,sse4.1,vaes,avx512f,avx512bw")))
+
+namespace {
+
+// Blocks per iteration. AESENC has a latency of several cycles but a
+// throughput of one or two per cycle, so independent blocks fill the gap.
+constexpr size_t LANES = 8;
+constexpr size_t WIDE_LANES = 16;
+
+uint64_t load_be64(const unsigned char* in) {
+    uint64_t value;
+    std::memcpy(&value, in, 8);
+    return __builtin_bswap64(value);
+}
+
+void store_be64(unsigned char* out, uint64_t value) {
+    value = __builtin_bswap64(value);
+    std::memcpy(out, &value, 8);
+}
+
+// 128-bit big-endian CTR counter, split so it can be bumped with plain adds.
+struct Counter {
+    uint64_t high;
+    uint64_t low;
+
+    explicit Counter(const unsigned char* block) : high(load_be64(block)), low(load_be64(block + 8)) {}
+
+    // Writes the current counter block and moves on to the next one.
+    void next(unsigned char* block) {
+        store_be64(block, high);
+        store_be64(block + 8, low);
+        if (++low == 0) {
+            ++high;
+        }
+    }
+
+    // Whether the next `blocks` counters share the high half, so they can be
+    // built in registers with 64-bit adds.
+    bool fits(size_t blocks) const {
+        return low <= UINT64_MAX - blocks;
+    }
+};
+
+// pshufb mask that reverses the 16 bytes of a block: a little-endian
+// (low, high) pair becomes the big-endian counter block.
+AESNI_TARGET inline __m128i byte_reverse_mask() {
+    return _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+}
+
+AESNI_TARGET __m128i expand_step(__m128i key, __m128i assist) {
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+AESNI_TARGET void load_keys(const unsigned char (*schedule)[16], __m128i* keys) {
+    for (int r = 0; r < 11; r++) {
+        keys[r] = _mm_load_si128(reinterpret_cast<const __m128i*>(schedule[r]));
+    }
+}
+
+template <size_t N, bool Decrypt>
+AESNI_TARGET inline void cipher_blocks(__m128i* blocks, const __m128i* keys) {
+    #pragma GCC unroll 16
+    for (size_t j = 0; j < N; j++) {
+        blocks[j] = _mm_xor_si128(blocks[j], keys[0]);
+    }
+    #pragma GCC unroll 9
+    for (int r = 1; r < 10; r++) {
+        #pragma GCC unroll 16
+        for (size_t j = 0; j < N; j++) {
+            blocks[j] = Decrypt ? _mm_aesdec_si128(blocks[j], keys[r]) : _mm_aesenc_si128(blocks[j], keys[r]);
+        }
+    }
+    #pragma GCC unroll 16
+    for (size_t j = 0; j < N; j++) {
+        blocks[j] = Decrypt ? _mm_aesdeclast_si128(blocks[j], keys[10]) : _mm_aesenclast_si128(blocks[j], keys[10]);
+    }
+}
+
+template <size_t N, bool Decrypt>
+VAES_TARGET inline void cipher_wide(__m512i* blocks, const __m512i* keys) {
+    #pragma GCC unroll 16
+    for (size_t j = 0; j < N; j++) {
+        blocks[j] = _mm512_xor_si512(blocks[j], keys[0]);
+    }
+    #pragma GCC unroll 9
+    for (int r = 1; r < 10; r++) {
+        #pragma GCC unroll 16
+        for (size_t j = 0; j < N; j++) {
+            blocks[j] = Decrypt ? _mm512_aesdec_epi128(blocks[j], keys[r]) : _mm512_aesenc_epi128(blocks[j], keys[r]);
+        }
+    }
+    #pragma GCC unroll 16
+    for (size_t j = 0; j < N; j++) {
+        blocks[j] = Decrypt ? _mm512_aesdeclast_epi128(blocks[j], keys[10])
+                            : _mm512_aesenclast_epi128(blocks[j], keys[10]);
+    }
+}
+
+VAES_TARGET void broadcast_keys(const __m128i* keys, __m512i* wide_keys) {
+    for (int r = 0; r < 11; r++) {
+        wide_keys[r] = _mm512_broadcast_i32x4(keys[r]);
+    }
+}
+
+AESNI_TARGET inline __m128i load_block(const unsigned char* in) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+}
+
+AESNI_TARGET inline void store_block(unsigned char* out, __m128i block) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), block);
+}
+
+VAES_TARGET inline __m512i load_wide(const unsigned char* in) {
+    return _mm512_loadu_si512(in);
+}
+
+VAES_TARGET inline void store_wide(unsigned char* out, __m512i blocks) {
+    _mm512_storeu_si512(out, blocks);
+}
+
+template <bool Decrypt>
+AESNI_TARGET void ecb_aesni(const __m128i* keys, const unsigned char* in, unsigned char* out, size_t blocks) {
+    size_t i = 0;
+    for (; i + LANES <= blocks; i += LANES) {
+        __m128i b[LANES];
+        for (size_t j = 0; j < LANES; j++) {
+            b[j] = load_block(in + (i + j) * 16);
+        }
+        cipher_blocks<LANES, Decrypt>(b, keys);
+        for (size_t j = 0; j < LANES; j++) {
+            store_block(out + (i + j) * 16, b[j]);
+        }
+    }
+    for (; i < blocks; i++) {
+        __m128i b[1] = {load_block(in + i * 16)};
+        cipher_blocks<1, Decrypt>(b, keys);
+        store_block(out + i * 16, b[0]);
+    }
+}
+
+template <bool Decrypt>
+VAES_TARGET void ecb_vaes(const __m128i* keys, const unsigned char* in, unsigned char* out, size_t blocks) {
+    __m512i wide_keys[11];
+    broadcast_keys(keys, wide_keys);
+
+    size_t i = 0;
+    for (; i + WIDE_LANES <= blocks; i += WIDE_LANES) {
+        __m512i b[4];
+        for (size_t j = 0; j < 4; j++) {
+            b[j] = load_wide(in + i * 16 + j * 64);
+        }
+        cipher_wide<4, Decrypt>(b, wide_keys);
+        for (size_t j = 0; j < 4; j++) {
+            store_wide(out + i * 16 + j * 64, b[j]);
+        }
+    }
+    ecb_aesni<Decrypt>(keys, in + i * 16, out + i * 16, blocks - i);
+}
+
+AESNI_TARGET void ctr_aesni(const __m128i* keys, Counter& counter, const unsigned char* in,
+                            unsigned char* out, size_t len) {
+    alignas(16) unsigned char counters[LANES][16];
+    size_t blocks = len / 16;
+    size_t i = 0;
+    const __m128i reverse = byte_reverse_mask();
+    for (; i + LANES <= blocks; i += LANES) {
+        __m128i b[LANES];
+        if (counter.fits(LANES)) {
+            __m128i base = _mm_set_epi64x(counter.high, counter.low);
+            for (size_t j = 0; j < LANES; j++) {
+                b[j] = _mm_shuffle_epi8(_mm_add_epi64(base, _mm_set_epi64x(0, j)), reverse);
+            }
+            counter.low += LANES;
+        } else {
+            for (size_t j = 0; j < LANES; j++) {
+                counter.next(counters[j]);
+                b[j] = _mm_load_si128(reinterpret_cast<const __m128i*>(counters[j]));
+            }
+        }
+        cipher_blocks<LANES, false>(b, keys);
+        for (size_t j = 0; j < LANES; j++) {
+            store_block(out + (i + j) * 16, _mm_xor_si128(b[j], load_block(in + (i + j) * 16)));
+        }
+    }
+    for (; i * 16 < len; i++) {
+        counter.next(counters[0]);
+        __m128i b[1] = {_mm_load_si128(reinterpret_cast<const __m128i*>(counters[0]))};
+        cipher_blocks<1, false>(b, keys);
+
+        size_t block_len = len - i * 16 < 16 ? len - i * 16 : 16;
+        if (block_len == 16) {
+            store_block(out + i * 16, _mm_xor_si128(b[0], load_block(in + i * 16)));
+        } else {
+            unsigned char keystream[16];
+            store_block(keystream, b[0]);
+            for (size_t t = 0; t < block_len; t++) {
+                out[i * 16 + t] = in[i * 16 + t] ^ keystream[t];
+            }
+        }
+    }
+}
+
+VAES_TARGET void ctr_vaes(const __m128i* keys, Counter& counter, const unsigned char* in,
+                          unsigned char* out, size_t len) {
+    __m512i wide_keys[11];
+    broadcast_keys(keys, wide_keys);
+
+    alignas(64) unsigned char counters[WIDE_LANES][16];
+    size_t blocks = len / 16;
+    size_t i = 0;
+    const __m512i reverse = _mm512_broadcast_i32x4(byte_reverse_mask());
+    const __m512i lane_offsets = _mm512_set_epi64(0, 3, 0, 2, 0, 1, 0, 0);
+    for (; i + WIDE_LANES <= blocks; i += WIDE_LANES) {
+        __m512i b[4];
+        if (counter.fits(WIDE_LANES)) {
+            __m512i base = _mm512_add_epi64(_mm512_broadcast_i32x4(_mm_set_epi64x(counter.high, counter.low)),
+                                            lane_offsets);
+            for (size_t j = 0; j < 4; j++) {
+                b[j] = _mm512_shuffle_epi8(_mm512_add_epi64(base, _mm512_set_epi64(0, j * 4, 0, j * 4, 0, j * 4, 0, j * 4)),
+                                           reverse);
+            }
+            counter.low += WIDE_LANES;
+        } else {
+            for (size_t j = 0; j < WIDE_LANES; j++) {
+                counter.next(counters[j]);
+            }
+            for (size_t j = 0; j < 4; j++) {
+                b[j] = _mm512_load_si512(counters[j * 4]);
+            }
+        }
+        cipher_wide<4, false>(b, wide_keys);
+        for (size_t j = 0; j < 4; j++) {
+            store_wide(out + i * 16 + j * 64, _mm512_xor_si512(b[j], load_wide(in + i * 16 + j * 64)));
+        }
+    }
+    ctr_aesni(keys, counter, in + i * 16, out + i * 16, len - i * 16);
+}
+
+AESNI_TARGET void cbc_decrypt_aesni(const __m128i* keys, __m128i previous, const unsigned char* in,
+                                    unsigned char* out, size_t blocks) {
+    size_t i = 0;
+    for (; i + LANES <= blocks; i += LANES) {
+        __m128i c[LANES];
+        __m128i b[LANES];
+        for (size_t j = 0; j < LANES; j++) {
+            b[j] = c[j] = load_block(in + (i + j) * 16);
+        }
+        cipher_blocks<LANES, true>(b, keys);
+        store_block(out + i * 16, _mm_xor_si128(b[0], previous));
+        for (size_t j = 1; j < LANES; j++) {
+            store_block(out + (i + j) * 16, _mm_xor_si128(b[j], c[j - 1]));
+        }
+        previous = c[LANES - 1];
+    }
+    for (; i < blocks; i++) {
+        __m128i c = load_block(in + i * 16);
+        __m128i b[1] = {c};
+        cipher_blocks<1, true>(b, keys);
+        store_block(out + i * 16, _mm_xor_si128(b[0], previous));
+        previous = c;
+    }
+}
+
+VAES_TARGET void cbc_decrypt_vaes(const __m128i* keys, __m128i previous, const unsigned char* in,
+                                  unsigned char* out, size_t blocks) {
+    __m512i wide_keys[11];
+    broadcast_keys(keys, wide_keys);
+
+    // `carry` holds the ciphertext block in front of the iteration in its top
+    // lane; alignr shifts every register one block up to line up the chain.
+    __m512i carry = _mm512_broadcast_i32x4(previous);
+    size_t i = 0;
+    for (; i + WIDE_LANES <= blocks; i += WIDE_LANES) {
+        __m512i c[4];
+        __m512i b[4];
+        for (size_t j = 0; j < 4; j++) {
+            b[j] = c[j] = load_wide(in + i * 16 + j * 64);
+        }
+        cipher_wide<4, true>(b, wide_keys);
+        store_wide(out + i * 16, _mm512_xor_si512(b[0], _mm512_alignr_epi64(c[0], carry, 6)));
+        for (size_t j = 1; j < 4; j++) {
+            store_wide(out + i * 16 + j * 64, _mm512_xor_si512(b[j], _mm512_alignr_epi64(c[j], c[j - 1], 6)));
+        }
+        carry = c[3];
+    }
+    cbc_decrypt_aesni(keys, _mm512_extracti32x4_epi32(carry, 3), in + i * 16, out + i * 16, blocks - i);
+}
+
+AESNI_TARGET void expand_key_aesni(const unsigned char* key, AesRoundKeys& keys) {
+    __m128i k[11];
+    k[0] = load_block(key);
+    k[1] = expand_step(k[0], _mm_aeskeygenassist_si128(k[0], 0x01));
+    k[2] = expand_step(k[1], _mm_aeskeygenassist_si128(k[1], 0x02));
+    k[3] = expand_step(k[2], _mm_aeskeygenassist_si128(k[2], 0x04));
+    k[4] = expand_step(k[3], _mm_aeskeygenassist_si128(k[3], 0x08));
+    k[5] = expand_step(k[4], _mm_aeskeygenassist_si128(k[4], 0x10));
+    k[6] = expand_step(k[5], _mm_aeskeygenassist_si128(k[5], 0x20));
+    k[7] = expand_step(k[6], _mm_aeskeygenassist_si128(k[6], 0x40));
+    k[8] = expand_step(k[7], _mm_aeskeygenassist_si128(k[7], 0x80));
+    k[9] = expand_step(k[8], _mm_aeskeygenassist_si128(k[8], 0x1b));
+    k[10] = expand_step(k[9], _mm_aeskeygenassist_si128(k[9], 0x36));
+
+    for (int r = 0; r < 11; r++) {
+        store_block(keys.enc[r], k[r]);
+        // the decryption schedule runs backwards through InvMixColumns
+        store_block(keys.dec[r], r == 0 || r == 10 ? k[10 - r] : _mm_aesimc_si128(k[10 - r]));
+    }
+}
+
+AESNI_TARGET void aes_ecb_encrypt_native(AesKernel kernel, const AesRoundKeys& keys, const unsigned char* input,
+                                  unsigned char* output, size_t blocks) {
+    __m128i k[11];
+    load_keys(keys.enc, k);
+    if (kernel == AesKernel::Vaes) {
+        ecb_vaes<false>(k, input, output, blocks);
+    } else {
+        ecb_aesni<false>(k, input, output, blocks);
+    }
+}
+
+AESNI_TARGET void aes_ecb_decrypt_native(AesKernel kernel, const AesRoundKeys& keys, const unsigned char* input,
+                                  unsigned char* output, size_t blocks) {
+    __m128i k[11];
+    load_keys(keys.dec, k);
+    if (kernel == AesKernel::Vaes) {
+        ecb_vaes<true>(k, input, output, blocks);
+    } else {
+        ecb_aesni<true>(k, input, output, blocks);
+    }
+}
+
+AESNI_TARGET void aes_ctr_xor_native(AesKernel kernel, const AesRoundKeys& keys, const unsigned char* counter,
+                              const unsigned char* input, unsigned char* output, size_t len) {
+    __m128i k[11];
+    load_keys(keys.enc, k);
+    Counter start(counter);
+    if (kernel == AesKernel::Vaes) {
+        ctr_vaes(k, start, input, output, len);
+    } else {
+        ctr_aesni(k, start, input, output, len);
+    }
+}
+
+AESNI_TARGET void aes_cbc_decrypt_native(AesKernel kernel, const AesRoundKeys& keys, const unsigned char* iv,
+                                  const unsigned char* input, unsigned char* output, size_t blocks) {
+    __m128i k[11];
+    load_keys(keys.dec, k);
+    if (kernel == AesKernel::Vaes) {
+        cbc_decrypt_vaes(k, load_block(iv), input, output, blocks);
+    } else {
+        cbc_decrypt_aesni(k, load_block(iv), input, output, blocks);
+    }
+}
+
+}  // namespace
+
+#endif
+
+// AES-NI/VAES go to the native functions; everything else, including any
+// non-x86 build, runs the bitsliced kernel.
+#ifdef AESCRYPT_X86
+#define AESCRYPT_NATIVE(kernel) ((kernel) == AesKernel::AesNi || (kernel) == AesKernel::Vaes)
+#else
+#define AESCRYPT_NATIVE(kernel) false
+#endif
+
+void aes_expand_key(AesKernel kernel, const unsigned char* key, AesRoundKeys& keys) {
+    if (AESCRYPT_NATIVE(kernel)) {
+        expand_key_aesni(key, keys);
+    } else {
+        soft_expand_key(key, keys.sliced);
+    }
+}
+
+void aes_ecb_encrypt(AesKernel kernel, const AesRoundKeys& keys, const unsigned char* input,
+                     unsigned char* output, size_t blocks) {
+    if (AESCRYPT_NATIVE(kernel)) {
+        aes_ecb_encrypt_native(kernel, keys, input, output, blocks);
+    } else {
+        soft_ecb_encrypt(keys.sliced, input, output, blocks);
+    }
+}
+
+void aes_ecb_decrypt(AesKernel kernel, const AesRoundKeys& keys, const unsigned char* input,
+                     unsigned char* output, size_t blocks) {
+    if (AESCRYPT_NATIVE(kernel)) {
+        aes_ecb_decrypt_native(kernel, keys, input, output, blocks);
+    } else {
+        soft_ecb_decrypt(keys.sliced, input, output, blocks);
+    }
+}
+
+void aes_ctr_xor(AesKernel kernel, const AesRoundKeys& keys, const unsigned char* counter,
+                 const unsigned char* input, unsigned char* output, size_t len) {
+    if (AESCRYPT_NATIVE(kernel)) {
+        aes_ctr_xor_native(kernel, keys, counter, input, output, len);
+    } else {
+        soft_ctr_xor(keys.sliced, counter, input, output, len);
+    }
+}
+
+void aes_cbc_decrypt(AesKernel kernel, const AesRoundKeys& keys, const unsigned char* iv,
+                     const unsigned char* input, unsigned char* output, size_t blocks) {
+    if (AESCRYPT_NATIVE(kernel)) {
+        aes_cbc_decrypt_native(kernel, keys, iv, input, output, blocks);
+    } else {
+        soft_cbc_decrypt(keys.sliced, iv, input, output, blocks);
+    }
+}
@@ -0,0 +1,54 @@
+// Native AES-128 kernels for the bulk modes (ECB, CTR and CBC decryption).
+// The AES-NI kernel keeps eight independent blocks in flight per iteration so
+// the AES units stay busy; the VAES kernel does the same with four blocks per
+// 512-bit register and four registers per iteration. Hosts without AES-NI get
+// the portable bitsliced kernel from aessoft.h. The kernel is picked once from
+// CPUID; EVP remains the path for everything else.
+#ifndef AESNI_H
+#define AESNI_H
+
+#include <cstddef>
+#include <cstdint>
+
+enum class AesKernel {
+    Evp,
+    Soft,
+    AesNi,
+    Vaes,
+};
+
+// Best kernel the CPU supports. AESCRYPT_KERNEL=evp|soft|aesni|vaes selects a
+// different one (never one the CPU lacks), e.g. to benchmark them.
+AesKernel detect_aes_kernel();
+
+const char* aes_kernel_name(AesKernel kernel);
+
+// AES-128 round keys: the encryption schedule and the equivalent inverse
+// cipher schedule that AESDEC expects, or the bitsliced schedule for
+// AesKernel::Soft.
+struct AesRoundKeys {
+    alignas(16) unsigned char enc[11][16];
+    alignas(16) unsigned char dec[11][16];
+    uint64_t sliced[11][8];
+};
+
+// The functions below need a kernel other than AesKernel::Evp.
+void aes_expand_key(AesKernel kernel, const unsigned char* key, AesRoundKeys& keys);
+
+void aes_ecb_encrypt(AesKernel kernel, const AesRoundKeys& keys, const unsigned char* input,
+                     unsigned char* output, size_t blocks);
+
+void aes_ecb_decrypt(AesKernel kernel, const AesRoundKeys& keys, const unsigned char* input,
+                     unsigned char* output, size_t blocks);
+
+// XORs the keystream that starts at the big-endian counter block `counter`
+// into `len` bytes; the last block may be partial.
+void aes_ctr_xor(AesKernel kernel, const AesRoundKeys& keys, const unsigned char* counter,
+                 const unsigned char* input, unsigned char* output, size_t len);
+
+// CBC decryption of whole blocks; `iv` is the ciphertext block in front of
+// `input`. Input and output may be the same buffer.
+void aes_cbc_decrypt(AesKernel kernel, const AesRoundKeys& keys, const unsigned char* iv,
+                     const unsigned char* input, unsigned char* output, size_t blocks);
+
+#endif
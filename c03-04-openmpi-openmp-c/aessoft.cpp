@@ -0,0 +1,507 @@
+#include "aessoft.h"
+
+#include <cstring>
+#include <initializer_list>
+
+// The bitsliced layout follows the 64-bit constant-time AES from BearSSL
+// (aes_ct64): eight 64-bit words hold one bit plane each of four blocks. Here
+// every word is a vector of four such words, so one pass covers 16 blocks and
+// the compiler maps it onto SSE2 or, where the CPU has it, AVX2.
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SOFT_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define SOFT_CLONES
+#endif
+
+#define SOFT_INLINE inline __attribute__((always_inline))
+
+namespace {
+
+typedef uint64_t Lanes __attribute__((vector_size(32)));
+
+constexpr size_t LANE_COUNT = sizeof(Lanes) / sizeof(uint64_t);
+constexpr size_t BATCH_BYTES = SOFT_BATCH_BLOCKS * 16;
+
+static_assert(LANE_COUNT * 4 == SOFT_BATCH_BLOCKS, "each lane holds four blocks");
+
+uint32_t load_le32(const unsigned char* in) {
+    return static_cast<uint32_t>(in[0]) | static_cast<uint32_t>(in[1]) << 8 | static_cast<uint32_t>(in[2]) << 16 |
+           static_cast<uint32_t>(in[3]) << 24;
+}
+
+void store_le32(unsigned char* out, uint32_t value) {
+    out[0] = static_cast<unsigned char>(value);
+    out[1] = static_cast<unsigned char>(value >> 8);
+    out[2] = static_cast<unsigned char>(value >> 16);
+    out[3] = static_cast<unsigned char>(value >> 24);
+}
+
+uint64_t load_be64(const unsigned char* in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = value << 8 | in[i];
+    }
+    return value;
+}
+
+void store_be64(unsigned char* out, uint64_t value) {
+    for (int i = 7; i >= 0; i--) {
+        out[i] = static_cast<unsigned char>(value);
+        value >>= 8;
+    }
+}
+
+// Transposes eight words between "byte per block" and "bit plane" order.
+template <typename W>
+SOFT_INLINE void swap_bits(W& x, W& y, uint64_t low_mask, int shift) {
+    W a = x;
+    W b = y;
+    x = (a & low_mask) | ((b & low_mask) << shift);
+    y = ((a & ~low_mask) >> shift) | (b & ~low_mask);
+}
+
+template <typename W>
+SOFT_INLINE void ortho(W* q) {
+    for (int i = 0; i < 8; i += 2) {
+        swap_bits(q[i], q[i + 1], 0x5555555555555555, 1);
+    }
+    for (int i : {0, 1, 4, 5}) {
+        swap_bits(q[i], q[i + 2], 0x3333333333333333, 2);
+    }
+    for (int i = 0; i < 4; i++) {
+        swap_bits(q[i], q[i + 4], 0x0F0F0F0F0F0F0F0F, 4);
+    }
+}
+
+// Spreads the four words of one block over two words, 16 bits per byte row.
+void interleave_in(uint64_t& q0, uint64_t& q1, const uint32_t* w) {
+    uint64_t x[4];
+    for (int i = 0; i < 4; i++) {
+        x[i] = w[i];
+        x[i] = (x[i] | x[i] << 16) & 0x0000FFFF0000FFFF;
+        x[i] = (x[i] | x[i] << 8) & 0x00FF00FF00FF00FF;
+    }
+    q0 = x[0] | x[2] << 8;
+    q1 = x[1] | x[3] << 8;
+}
+
+void interleave_out(uint32_t* w, uint64_t q0, uint64_t q1) {
+    uint64_t x[4] = {q0 & 0x00FF00FF00FF00FF, q1 & 0x00FF00FF00FF00FF, (q0 >> 8) & 0x00FF00FF00FF00FF,
+                     (q1 >> 8) & 0x00FF00FF00FF00FF};
+    for (int i = 0; i < 4; i++) {
+        x[i] = (x[i] | x[i] >> 8) & 0x0000FFFF0000FFFF;
+        w[i] = static_cast<uint32_t>(x[i]) | static_cast<uint32_t>(x[i] >> 16);
+    }
+}
+
+// The AES S-box as the 113-gate circuit of Boyar and Peralta, "A new
+// combinational logic minimization technique with applications to
+// cryptology". q[0] is the low bit plane.
+template <typename W>
+SOFT_INLINE void sub_bytes(W* q) {
+    W x0 = q[7], x1 = q[6], x2 = q[5], x3 = q[4], x4 = q[3], x5 = q[2], x6 = q[1], x7 = q[0];
+
+    // top linear transformation
+    W y14 = x3 ^ x5;
+    W y13 = x0 ^ x6;
+    W y9 = x0 ^ x3;
+    W y8 = x0 ^ x5;
+    W t0 = x1 ^ x2;
+    W y1 = t0 ^ x7;
+    W y4 = y1 ^ x3;
+    W y12 = y13 ^ y14;
+    W y2 = y1 ^ x0;
+    W y5 = y1 ^ x6;
+    W y3 = y5 ^ y8;
+    W t1 = x4 ^ y12;
+    W y15 = t1 ^ x5;
+    W y20 = t1 ^ x1;
+    W y6 = y15 ^ x7;
+    W y10 = y15 ^ t0;
+    W y11 = y20 ^ y9;
+    W y7 = x7 ^ y11;
+    W y17 = y10 ^ y11;
+    W y19 = y10 ^ y8;
+    W y16 = t0 ^ y11;
+    W y21 = y13 ^ y16;
+    W y18 = x0 ^ y16;
+
+    // non-linear section
+    W t2 = y12 & y15;
+    W t3 = y3 & y6;
+    W t4 = t3 ^ t2;
+    W t5 = y4 & x7;
+    W t6 = t5 ^ t2;
+    W t7 = y13 & y16;
+    W t8 = y5 & y1;
+    W t9 = t8 ^ t7;
+    W t10 = y2 & y7;
+    W t11 = t10 ^ t7;
+    W t12 = y9 & y11;
+    W t13 = y14 & y17;
+    W t14 = t13 ^ t12;
+    W t15 = y8 & y10;
+    W t16 = t15 ^ t12;
+    W t17 = t4 ^ t14;
+    W t18 = t6 ^ t16;
+    W t19 = t9 ^ t14;
+    W t20 = t11 ^ t16;
+    W t21 = t17 ^ y20;
+    W t22 = t18 ^ y19;
+    W t23 = t19 ^ y21;
+    W t24 = t20 ^ y18;
+
+    W t25 = t21 ^ t22;
+    W t26 = t21 & t23;
+    W t27 = t24 ^ t26;
+    W t28 = t25 & t27;
+    W t29 = t28 ^ t22;
+    W t30 = t23 ^ t24;
+    W t31 = t22 ^ t26;
+    W t32 = t31 & t30;
+    W t33 = t32 ^ t24;
+    W t34 = t23 ^ t33;
+    W t35 = t27 ^ t33;
+    W t36 = t24 & t35;
+    W t37 = t36 ^ t34;
+    W t38 = t27 ^ t36;
+    W t39 = t29 & t38;
+    W t40 = t25 ^ t39;
+
+    W t41 = t40 ^ t37;
+    W t42 = t29 ^ t33;
+    W t43 = t29 ^ t40;
+    W t44 = t33 ^ t37;
+    W t45 = t42 ^ t41;
+    W z0 = t44 & y15;
+    W z1 = t37 & y6;
+    W z2 = t33 & x7;
+    W z3 = t43 & y16;
+    W z4 = t40 & y1;
+    W z5 = t29 & y7;
+    W z6 = t42 & y11;
+    W z7 = t45 & y17;
+    W z8 = t41 & y10;
+    W z9 = t44 & y12;
+    W z10 = t37 & y3;
+    W z11 = t33 & y4;
+    W z12 = t43 & y13;
+    W z13 = t40 & y5;
+    W z14 = t29 & y2;
+    W z15 = t42 & y9;
+    W z16 = t45 & y14;
+    W z17 = t41 & y8;
+
+    // bottom linear transformation
+    W t46 = z15 ^ z16;
+    W t47 = z10 ^ z11;
+    W t48 = z5 ^ z13;
+    W t49 = z9 ^ z10;
+    W t50 = z2 ^ z12;
+    W t51 = z2 ^ z5;
+    W t52 = z7 ^ z8;
+    W t53 = z0 ^ z3;
+    W t54 = z6 ^ z7;
+    W t55 = z16 ^ z17;
+    W t56 = z12 ^ t48;
+    W t57 = t50 ^ t53;
+    W t58 = z4 ^ t46;
+    W t59 = z3 ^ t54;
+    W t60 = t46 ^ t57;
+    W t61 = z14 ^ t57;
+    W t62 = t52 ^ t58;
+    W t63 = t49 ^ t58;
+    W t64 = z4 ^ t59;
+    W t65 = t61 ^ t62;
+    W t66 = z1 ^ t63;
+    W s0 = t59 ^ t63;
+    W s6 = t56 ^ ~t62;
+    W s7 = t48 ^ ~t60;
+    W t67 = t64 ^ t65;
+    W s3 = t53 ^ t66;
+    W s4 = t51 ^ t66;
+    W s5 = t47 ^ t65;
+    W s1 = t64 ^ ~s3;
+    W s2 = t55 ^ ~t67;
+
+    q[7] = s0;
+    q[6] = s1;
+    q[5] = s2;
+    q[4] = s3;
+    q[3] = s4;
+    q[2] = s5;
+    q[1] = s6;
+    q[0] = s7;
+}
+
+// Undoes the S-box's affine step: y -> L^-1(y ^ 0x63), where L^-1 XORs the
+// bits 2, 5 and 7 places further along and L^-1(0x63) = 0x05.
+template <typename W>
+SOFT_INLINE void inverse_affine(W* q) {
+    W p[8];
+    for (int i = 0; i < 8; i++) {
+        p[i] = q[(i + 2) % 8] ^ q[(i + 5) % 8] ^ q[(i + 7) % 8];
+    }
+    for (int i = 0; i < 8; i++) {
+        q[i] = (0x05 >> i & 1) ? ~p[i] : p[i];
+    }
+}
+
+// InvSubBytes(y) = inv(A^-1(y)), and inv(z) = A^-1(SubBytes(z)).
+template <typename W>
+SOFT_INLINE void inv_sub_bytes(W* q) {
+    inverse_affine(q);
+    sub_bytes(q);
+    inverse_affine(q);
+}
+
+template <typename W>
+SOFT_INLINE void shift_rows(W* q) {
+    for (int i = 0; i < 8; i++) {
+        W x = q[i];
+        q[i] = (x & 0x000000000000FFFF) | ((x & 0x00000000FFF00000) >> 4) | ((x & 0x00000000000F0000) << 12) |
+               ((x & 0x0000FF0000000000) >> 8) | ((x & 0x000000FF00000000) << 8) |
+               ((x & 0xF000000000000000) >> 12) | ((x & 0x0FFF000000000000) << 4);
+    }
+}
+
+template <typename W>
+SOFT_INLINE void inv_shift_rows(W* q) {
+    for (int i = 0; i < 8; i++) {
+        W x = q[i];
+        q[i] = (x & 0x000000000000FFFF) | ((x & 0x000000000FFF0000) << 4) | ((x & 0x00000000F0000000) >> 12) |
+               ((x & 0x000000FF00000000) << 8) | ((x & 0x0000FF0000000000) >> 8) |
+               ((x & 0x000F000000000000) << 12) | ((x & 0xFFF0000000000000) >> 4);
+    }
+}
+
+// Moves every column `rows` rows up: each row is 16 bits of a word.
+template <typename W>
+SOFT_INLINE void rotate_rows(const W* x, W* out, int rows) {
+    for (int i = 0; i < 8; i++) {
+        out[i] = (x[i] >> (16 * rows)) | (x[i] << (64 - 16 * rows));
+    }
+}
+
+// Multiplication by {02} in GF(2^8), bit plane by bit plane.
+template <typename W>
+SOFT_INLINE void xtime(const W* x, W* out) {
+    out[0] = x[7];
+    out[1] = x[0] ^ x[7];
+    out[2] = x[1];
+    out[3] = x[2] ^ x[7];
+    out[4] = x[3] ^ x[7];
+    out[5] = x[4];
+    out[6] = x[5];
+    out[7] = x[6];
+}
+
+// out = {02}(a ^ b) ^ b ^ c ^ d per column, with b, c and d the next rows
+// down: the column below shifted by one row is one 16-bit rotation.
+template <typename W>
+SOFT_INLINE void mix_columns(W* q) {
+    W sum[8];
+    W doubled[8];
+    W next[8];
+    W far[8];
+    rotate_rows(q, next, 1);
+    for (int i = 0; i < 8; i++) {
+        sum[i] = q[i] ^ next[i];
+    }
+    xtime(sum, doubled);
+    rotate_rows(sum, far, 2);
+    for (int i = 0; i < 8; i++) {
+        q[i] = doubled[i] ^ next[i] ^ far[i];
+    }
+}
+
+// InvMixColumns is MixColumns after multiplying each column by
+// {04}x^2 + {05}: a ^ {04}(a ^ c), with c two rows down.
+template <typename W>
+SOFT_INLINE void inv_mix_columns(W* q) {
+    W t[8];
+    W quad[8];
+    rotate_rows(q, t, 2);
+    for (int i = 0; i < 8; i++) {
+        t[i] ^= q[i];
+    }
+    xtime(t, quad);
+    xtime(quad, t);
+    for (int i = 0; i < 8; i++) {
+        q[i] ^= t[i];
+    }
+    mix_columns(q);
+}
+
+template <typename W>
+SOFT_INLINE void add_round_key(W* q, const uint64_t* key) {
+    for (int i = 0; i < 8; i++) {
+        q[i] ^= key[i];
+    }
+}
+
+// Bitslices SOFT_BATCH_BLOCKS blocks: lane l holds blocks 4l to 4l + 3.
+SOFT_INLINE void load_batch(const unsigned char* in, Lanes* q) {
+    for (size_t lane = 0; lane < LANE_COUNT; lane++) {
+        uint32_t w[16];
+        for (int i = 0; i < 16; i++) {
+            w[i] = load_le32(in + lane * 64 + i * 4);
+        }
+        uint64_t s[8];
+        for (int i = 0; i < 4; i++) {
+            interleave_in(s[i], s[i + 4], w + i * 4);
+        }
+        for (int i = 0; i < 8; i++) {
+            q[i][lane] = s[i];
+        }
+    }
+    ortho(q);
+}
+
+SOFT_INLINE void store_batch(Lanes* q, unsigned char* out) {
+    ortho(q);
+    for (size_t lane = 0; lane < LANE_COUNT; lane++) {
+        uint32_t w[16];
+        for (int i = 0; i < 4; i++) {
+            interleave_out(w + i * 4, q[i][lane], q[i + 4][lane]);
+        }
+        for (int i = 0; i < 16; i++) {
+            store_le32(out + lane * 64 + i * 4, w[i]);
+        }
+    }
+}
+
+// Encrypts or decrypts one batch of SOFT_BATCH_BLOCKS blocks in place.
+SOFT_CLONES void encrypt_batch(const uint64_t sliced[11][8], unsigned char* blocks) {
+    Lanes q[8];
+    load_batch(blocks, q);
+    add_round_key(q, sliced[0]);
+    for (int r = 1; r < 10; r++) {
+        sub_bytes(q);
+        shift_rows(q);
+        mix_columns(q);
+        add_round_key(q, sliced[r]);
+    }
+    sub_bytes(q);
+    shift_rows(q);
+    add_round_key(q, sliced[10]);
+    store_batch(q, blocks);
+}
+
+SOFT_CLONES void decrypt_batch(const uint64_t sliced[11][8], unsigned char* blocks) {
+    Lanes q[8];
+    load_batch(blocks, q);
+    add_round_key(q, sliced[10]);
+    for (int r = 9; r > 0; r--) {
+        inv_shift_rows(q);
+        inv_sub_bytes(q);
+        add_round_key(q, sliced[r]);
+        inv_mix_columns(q);
+    }
+    inv_shift_rows(q);
+    inv_sub_bytes(q);
+    add_round_key(q, sliced[0]);
+    store_batch(q, blocks);
+}
+
+uint32_t sub_word(uint32_t x) {
+    uint64_t q[8] = {x};
+    ortho(q);
+    sub_bytes(q);
+    ortho(q);
+    return static_cast<uint32_t>(q[0]);
+}
+
+// Runs `blocks` blocks through a batch function; the last partial batch is
+// padded in a scratch buffer so every block takes the same path.
+template <typename Batch>
+void run_batches(Batch batch, const uint64_t sliced[11][8], const unsigned char* input, unsigned char* output,
+                 size_t blocks) {
+    alignas(32) unsigned char buffer[BATCH_BYTES];
+    for (size_t i = 0; i < blocks; i += SOFT_BATCH_BLOCKS) {
+        size_t len = (blocks - i < SOFT_BATCH_BLOCKS ? blocks - i : SOFT_BATCH_BLOCKS) * 16;
+        std::memcpy(buffer, input + i * 16, len);
+        batch(sliced, buffer);
+        std::memcpy(output + i * 16, buffer, len);
+    }
+}
+
+}  // namespace
+
+void soft_expand_key(const unsigned char* key, uint64_t sliced[11][8]) {
+    static const uint32_t rcon[10] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1B, 0x36};
+
+    uint32_t words[44];
+    for (int i = 0; i < 4; i++) {
+        words[i] = load_le32(key + i * 4);
+    }
+    for (int i = 4; i < 44; i++) {
+        uint32_t tmp = words[i - 1];
+        if (i % 4 == 0) {
+            tmp = sub_word(tmp << 24 | tmp >> 8) ^ rcon[i / 4 - 1];
+        }
+        words[i] = words[i - 4] ^ tmp;
+    }
+
+    // the same round key for all four block slots of a word
+    for (int r = 0; r < 11; r++) {
+        uint64_t q[8];
+        interleave_in(q[0], q[4], words + r * 4);
+        q[1] = q[2] = q[3] = q[0];
+        q[5] = q[6] = q[7] = q[4];
+        ortho(q);
+        std::memcpy(sliced[r], q, sizeof(q));
+    }
+}
+
+void soft_ecb_encrypt(const uint64_t sliced[11][8], const unsigned char* input, unsigned char* output,
+                      size_t blocks) {
+    run_batches(encrypt_batch, sliced, input, output, blocks);
+}
+
+void soft_ecb_decrypt(const uint64_t sliced[11][8], const unsigned char* input, unsigned char* output,
+                      size_t blocks) {
+    run_batches(decrypt_batch, sliced, input, output, blocks);
+}
+
+void soft_ctr_xor(const uint64_t sliced[11][8], const unsigned char* counter, const unsigned char* input,
+                  unsigned char* output, size_t len) {
+    alignas(32) unsigned char keystream[BATCH_BYTES];
+    uint64_t high = load_be64(counter);
+    uint64_t low = load_be64(counter + 8);
+
+    for (size_t done = 0; done < len; done += BATCH_BYTES) {
+        for (size_t j = 0; j < SOFT_BATCH_BLOCKS; j++) {
+            store_be64(keystream + j * 16, high);
+            store_be64(keystream + j * 16 + 8, low);
+            low++;
+            high += low == 0;
+        }
+        encrypt_batch(sliced, keystream);
+
+        size_t chunk = len - done < BATCH_BYTES ? len - done : BATCH_BYTES;
+        for (size_t t = 0; t < chunk; t++) {
+            output[done + t] = input[done + t] ^ keystream[t];
+        }
+    }
+}
+
+void soft_cbc_decrypt(const uint64_t sliced[11][8], const unsigned char* iv, const unsigned char* input,
+                      unsigned char* output, size_t blocks) {
+    alignas(32) unsigned char buffer[BATCH_BYTES];
+    unsigned char chain[BATCH_BYTES + 16];
+    std::memcpy(chain, iv, 16);
+
+    for (size_t i = 0; i < blocks; i += SOFT_BATCH_BLOCKS) {
+        size_t len = (blocks - i < SOFT_BATCH_BLOCKS ? blocks - i : SOFT_BATCH_BLOCKS) * 16;
+        // keep the ciphertext: output may overwrite it
+        std::memcpy(chain + 16, input + i * 16, len);
+        std::memcpy(buffer, chain + 16, len);
+        decrypt_batch(sliced, buffer);
+        for (size_t t = 0; t < len; t++) {
+            output[i * 16 + t] = buffer[t] ^ chain[t];
+        }
+        std::memcpy(chain, chain + len, 16);
+    }
+}
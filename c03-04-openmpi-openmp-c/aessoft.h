@@ -0,0 +1,29 @@
+// Portable constant-time AES-128 for hosts without AES-NI. Blocks are
+// bitsliced in groups of SOFT_BATCH_BLOCKS and the S-box is a boolean
+// circuit, so there are no secret-dependent table lookups or branches.
+// Called through the kernel functions in aesni.h with AesKernel::Soft.
+#ifndef AESSOFT_H
+#define AESSOFT_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Blocks encrypted per call of the bitsliced core: four 64-bit lanes of
+// four blocks each.
+constexpr size_t SOFT_BATCH_BLOCKS = 16;
+
+void soft_expand_key(const unsigned char* key, uint64_t sliced[11][8]);
+
+void soft_ecb_encrypt(const uint64_t sliced[11][8], const unsigned char* input, unsigned char* output,
+                      size_t blocks);
+
+void soft_ecb_decrypt(const uint64_t sliced[11][8], const unsigned char* input, unsigned char* output,
+                      size_t blocks);
+
+void soft_ctr_xor(const uint64_t sliced[11][8], const unsigned char* counter, const unsigned char* input,
+                  unsigned char* output, size_t len);
+
+void soft_cbc_decrypt(const uint64_t sliced[11][8], const unsigned char* iv, const unsigned char* input,
+                      unsigned char* output, size_t blocks);
+
+#endif
@@ -0,0 +1,262 @@
+#include "blockzip.h"
+
+#include "aescrypt.h"
+
+#include <fcntl.h>
+#include <omp.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+constexpr size_t HEADER_SIZE = 32;
+constexpr uint16_t VERSION = 1;
+constexpr uint32_t STORED = 0x80000000u;
+
+// Largest block a file may declare, so a bad header cannot ask for huge buffers.
+constexpr uint64_t MAX_BLOCK_SIZE = 64 << 20;
+
+// Blocks per thread in a batch; blocks deflate at different speeds, so the
+// threads take them one at a time from a batch of several each.
+constexpr size_t BATCH_BLOCKS_PER_THREAD = 4;
+
+int thread_count(int threads) {
+    return threads > 0 ? threads : omp_get_max_threads();
+}
+
+uint64_t file_size(std::ifstream& file) {
+    file.seekg(0, std::ios::end);
+    uint64_t size = file.tellg();
+    file.seekg(0, std::ios::beg);
+    return size;
+}
+
+}  // namespace
+
+void compress_blocks(const unsigned char* input, size_t len, int level, std::vector<unsigned char>& packed,
+                     std::vector<uint32_t>& lengths, int threads) {
+    uint64_t count = zblock_count(len);
+    threads = thread_count(threads);
+    size_t batch = threads * BATCH_BLOCKS_PER_THREAD;
+    size_t bound = compressBound(ZBLOCK_SIZE);
+    std::vector<unsigned char> scratch(std::min<uint64_t>(batch, count) * bound);
+    size_t first_length = lengths.size();
+    lengths.resize(first_length + count);
+
+    for (uint64_t first = 0; first < count; first += batch) {
+        long long blocks = std::min<uint64_t>(batch, count - first);
+        const unsigned char* plain = input + first * ZBLOCK_SIZE;
+        size_t batch_len = std::min<uint64_t>(blocks * ZBLOCK_SIZE, len - first * ZBLOCK_SIZE);
+        uint32_t* batch_lengths = lengths.data() + first_length + first;
+
+        #pragma omp parallel for schedule(dynamic) num_threads(threads)
+        for (long long i = 0; i < blocks; i++) {
+            const unsigned char* block = plain + i * ZBLOCK_SIZE;
+            size_t block_len = std::min<size_t>(ZBLOCK_SIZE, batch_len - i * ZBLOCK_SIZE);
+            unsigned char* out = scratch.data() + i * bound;
+            uLongf out_len = bound;
+            if (compress2(out, &out_len, block, block_len, level) == Z_OK && out_len < block_len) {
+                batch_lengths[i] = out_len;
+            } else {
+                std::memcpy(out, block, block_len);
+                batch_lengths[i] = block_len | STORED;
+            }
+        }
+
+        for (long long i = 0; i < blocks; i++) {
+            const unsigned char* out = scratch.data() + i * bound;
+            packed.insert(packed.end(), out, out + (batch_lengths[i] & ~STORED));
+        }
+    }
+}
+
+uint64_t zblock_count(uint64_t size) {
+    return (size + ZBLOCK_SIZE - 1) / ZBLOCK_SIZE;
+}
+
+ZBlockStream::ZBlockStream(const std::string& path, int level, int threads)
+    : level(level), threads(thread_count(threads)) {
+    fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        throw std::runtime_error("Error opening input file.");
+    }
+    file_size = st.st_size;
+}
+
+ZBlockStream::~ZBlockStream() {
+    ::close(fd);
+}
+
+uint64_t ZBlockStream::input_size() const {
+    return file_size;
+}
+
+bool ZBlockStream::read_input(uint64_t offset, unsigned char* out, size_t len) const {
+    while (len > 0) {
+        ssize_t n = pread(fd, out, len, offset);
+        if (n <= 0) {
+            return false;
+        }
+        out += n;
+        offset += n;
+        len -= n;
+    }
+    return true;
+}
+
+void ZBlockStream::set_lengths(std::vector<uint32_t> block_lengths) {
+    lengths = std::move(block_lengths);
+    uint64_t count = lengths.size();
+    layout.assign(HEADER_SIZE + count * 4, 0);
+    std::memcpy(layout.data(), "PZLB", 4);
+    put_le(layout.data() + 4, VERSION, 2);
+    put_le(layout.data() + 8, ZBLOCK_SIZE, 4);
+    put_le(layout.data() + 16, count, 8);
+    put_le(layout.data() + 24, file_size, 8);
+    offsets.assign(count + 1, layout.size());
+    for (uint64_t i = 0; i < count; i++) {
+        put_le(layout.data() + HEADER_SIZE + i * 4, lengths[i], 4);
+        offsets[i + 1] = offsets[i] + (lengths[i] & ~STORED);
+    }
+}
+
+void ZBlockStream::keep_blocks(std::vector<unsigned char> data) {
+    blocks = std::move(data);
+}
+
+uint64_t ZBlockStream::size() const {
+    return offsets.back();
+}
+
+void ZBlockStream::read(uint64_t offset, unsigned char* out, size_t len) const {
+    uint64_t end = offset + len;
+    if (offset < layout.size()) {
+        size_t n = std::min<uint64_t>(end, layout.size()) - offset;
+        std::memcpy(out, layout.data() + offset, n);
+        out += n;
+        offset += n;
+    }
+    if (offset >= end) {
+        return;
+    }
+    if (!blocks.empty()) {
+        std::memcpy(out, blocks.data() + (offset - layout.size()), end - offset);
+        return;
+    }
+
+    uint64_t count = lengths.size();
+    size_t batch = threads * BATCH_BLOCKS_PER_THREAD;
+    uint64_t first = std::upper_bound(offsets.begin(), offsets.end(), offset) - offsets.begin() - 1;
+    std::vector<unsigned char> plain, packed;
+    std::vector<uint32_t> batch_lengths;
+    for (uint64_t i = first; i < count && offsets[i] < end; ) {
+        // up to a batch of blocks, and none past the range
+        uint64_t last = std::lower_bound(offsets.begin() + i + 1, offsets.begin() + count, end) - offsets.begin();
+        last = std::min<uint64_t>(last, i + batch);
+        uint64_t plain_begin = i * ZBLOCK_SIZE;
+        size_t plain_len = std::min<uint64_t>(last * ZBLOCK_SIZE, file_size) - plain_begin;
+        plain.resize(plain_len);
+        if (!read_input(plain_begin, plain.data(), plain_len)) {
+            throw std::runtime_error("Error reading input file.");
+        }
+        packed.clear();
+        batch_lengths.clear();
+        compress_blocks(plain.data(), plain_len, level, packed, batch_lengths, threads);
+        if (!std::equal(batch_lengths.begin(), batch_lengths.end(), lengths.begin() + i)) {
+            throw std::runtime_error("Input file changed while it was compressed.");
+        }
+
+        uint64_t from = std::max(offset, offsets[i]);
+        uint64_t to = std::min(end, offsets[last]);
+        std::memcpy(out + (from - offset), packed.data() + (from - offsets[i]), to - from);
+        i = last;
+    }
+}
+
+long long decompress_file(const std::string& input_path, const std::string& output_path, int threads) {
+    std::ifstream input(input_path, std::ios::binary);
+    if (!input) {
+        return -1;
+    }
+    uint64_t packed_size = file_size(input);
+
+    unsigned char header[HEADER_SIZE];
+    if (packed_size < HEADER_SIZE || !input.read(reinterpret_cast<char*>(header), HEADER_SIZE) ||
+        std::memcmp(header, "PZLB", 4) != 0 || get_le(header + 4, 2) != VERSION) {
+        return -1;
+    }
+    uint64_t block_size = get_le(header + 8, 4);
+    uint64_t count = get_le(header + 16, 8);
+    uint64_t size = get_le(header + 24, 8);
+    if (block_size == 0 || block_size > MAX_BLOCK_SIZE || count != (size + block_size - 1) / block_size ||
+        count > (packed_size - HEADER_SIZE) / 4) {
+        return -1;
+    }
+
+    // every block's place in the file, and the file has to end with the last
+    std::vector<unsigned char> table(count * 4);
+    input.read(reinterpret_cast<char*>(table.data()), table.size());
+    std::vector<uint32_t> lengths(count);
+    std::vector<uint64_t> offsets(count + 1, HEADER_SIZE + table.size());
+    for (uint64_t i = 0; i < count; i++) {
+        lengths[i] = get_le(table.data() + i * 4, 4);
+        uint64_t block_len = std::min(block_size, size - i * block_size);
+        if ((lengths[i] & STORED) && (lengths[i] & ~STORED) != block_len) {
+            return -1;
+        }
+        offsets[i + 1] = offsets[i] + (lengths[i] & ~STORED);
+    }
+    if (!input || offsets[count] != packed_size) {
+        return -1;
+    }
+
+    std::ofstream output(output_path, std::ios::binary);
+    if (!output) {
+        return -1;
+    }
+    threads = thread_count(threads);
+    size_t batch = threads * BATCH_BLOCKS_PER_THREAD;
+    std::vector<unsigned char> plain(std::min<uint64_t>(batch * block_size, size));
+    std::vector<unsigned char> packed;
+
+    for (uint64_t first = 0; first < count; first += batch) {
+        long long blocks = std::min<uint64_t>(batch, count - first);
+        size_t len = std::min<uint64_t>(blocks * block_size, size - first * block_size);
+        packed.resize(offsets[first + blocks] - offsets[first]);
+        if (!input.read(reinterpret_cast<char*>(packed.data()), packed.size())) {
+            return -1;
+        }
+
+        bool failed = false;
+        #pragma omp parallel for schedule(dynamic) num_threads(threads) reduction(||:failed)
+        for (long long i = 0; i < blocks; i++) {
+            const unsigned char* in = packed.data() + (offsets[first + i] - offsets[first]);
+            uLong in_len = lengths[first + i] & ~STORED;
+            unsigned char* block = plain.data() + i * block_size;
+            uLongf block_len = std::min<uint64_t>(block_size, len - i * block_size);
+            if (lengths[first + i] & STORED) {
+                std::memcpy(block, in, in_len);
+            } else {
+                uLongf expected = block_len;
+                failed = failed || uncompress(block, &block_len, in, in_len) != Z_OK || block_len != expected;
+            }
+        }
+        if (failed) {
+            return -1;
+        }
+        output.write(reinterpret_cast<const char*>(plain.data()), len);
+    }
+    output.close();
+    return output ? static_cast<long long>(size) : -1;
+}
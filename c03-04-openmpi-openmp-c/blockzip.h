@@ -0,0 +1,87 @@
+// Block-compressed streams for --compress. The input is cut into blocks of
+// ZBLOCK_SIZE bytes that are deflated with zlib independently, so the ranks
+// each compress their own blocks, and OpenMP threads compress and inflate
+// them in parallel, a batch of blocks at a time to keep memory bounded. A
+// block that does not shrink is stored as is.
+//
+//   header  "PZLB", u16 version, u16 reserved, u32 block size,
+//           u32 reserved, u64 block count, u64 original size
+//   table   per block: u32 stored length, high bit set if stored uncompressed
+//   data    blocks back to back
+//
+// Integers are little-endian, as in the segmented containers.
+#ifndef BLOCKZIP_H
+#define BLOCKZIP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+constexpr size_t ZBLOCK_SIZE = 1 << 20;
+
+// Level used when --compress gives none: fast, and BMPs still shrink a lot.
+constexpr int ZBLOCK_DEFAULT_LEVEL = 1;
+
+// Deflates the `len` bytes at `input`, whole blocks but for the last one of
+// the stream, at zlib `level` (1-9) with `threads` OpenMP threads (0 for the
+// OpenMP default). Appends the blocks as stored to `packed` and their table
+// entries to `lengths`.
+void compress_blocks(const unsigned char* input, size_t len, int level, std::vector<unsigned char>& packed,
+                     std::vector<uint32_t>& lengths, int threads = 0);
+
+// Number of blocks of a stream holding `size` bytes.
+uint64_t zblock_count(uint64_t size);
+
+// The block stream of a file, as the input of an --compress encryption. The
+// table leads the stream, so set_lengths() first takes the length of every
+// block, from compress_blocks() runs over the whole file. read() then serves
+// any range of the stream: out of the blocks given to keep_blocks(), or else
+// by deflating the blocks under the range again, a batch at a time, so only
+// a batch of blocks is ever held.
+class ZBlockStream {
+private:
+    int fd = -1;
+    uint64_t file_size = 0;
+    int level;
+    int threads;
+    std::vector<unsigned char> layout;
+    std::vector<uint32_t> lengths;
+    // where each block starts in the stream, and where the stream ends
+    std::vector<uint64_t> offsets;
+    std::vector<unsigned char> blocks;
+
+public:
+    // Opens `path` to deflate at zlib `level` with `threads` OpenMP threads (0
+    // for the OpenMP default). Throws std::runtime_error if it cannot.
+    ZBlockStream(const std::string& path, int level, int threads = 0);
+
+    ~ZBlockStream();
+
+    ZBlockStream(const ZBlockStream&) = delete;
+    ZBlockStream& operator=(const ZBlockStream&) = delete;
+
+    uint64_t input_size() const;
+
+    // Reads `len` bytes of the file at `offset`. Returns false if it cannot.
+    bool read_input(uint64_t offset, unsigned char* out, size_t len) const;
+
+    void set_lengths(std::vector<uint32_t> block_lengths);
+
+    // Every block of the stream as stored, back to back.
+    void keep_blocks(std::vector<unsigned char> data);
+
+    uint64_t size() const;
+
+    // Copies `len` bytes of the stream at `offset` to `out`. Throws
+    // std::runtime_error if the file cannot be read or no longer deflates to
+    // the blocks of the table.
+    void read(uint64_t offset, unsigned char* out, size_t len) const;
+};
+
+// Restores the original from a file holding such a stream. Returns its size,
+// or -1 if `input_path` is not such a file, a block does not inflate to its
+// size, or either file cannot be read or written.
+long long decompress_file(const std::string& input_path, const std::string& output_path, int threads = 0);
+
+#endif
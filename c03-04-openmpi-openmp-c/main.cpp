@@ -2,479 +2,2225 @@
 #include <iostream>
 #include <unistd.h>
 #include <limits.h>
-#include <omp.h>
 #include <fstream>
 #include <string>
 #include <sstream>
 #include <vector>
-#include <openssl/evp.h>
-#include <openssl/aes.h>
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <omp.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <openssl/rand.h>
 
-class AESCipher {
-private:
-    unsigned char key[16];
-    unsigned char iv[16];
+#include "aescrypt.h"
+#include "blockzip.h"
 
-public:
-    AESCipher(const std::string& key_str) {
-        if (key_str.size() != 16) {
-            throw std::invalid_argument("Key must be 16 bytes for AES-128");
+// Rank ranges are whole pages, so every rank (and each of its threads) runs
+// full-block bulk updates and nothing straddles an AES block.
+constexpr size_t RANK_ALIGNMENT = 4096;
+
+// MPI counts bytes in int. A window never exceeds MAX_WINDOW_SIZE (plus its
+// tail), so no scatter, gather or file count can overflow.
+constexpr size_t MAX_WINDOW_SIZE = 1 << 30;
+
+// Nearest rank in direction `step` (+1/-1) whose range is non-empty, or
+// MPI_PROC_NULL. Small inputs leave some ranks idle, and halo exchanges
+// have to skip over them.
+int nearest_rank_with_data(size_t total, int world_size, int rank, int step, size_t alignment) {
+    for (int i = rank + step; i >= 0 && i < world_size; i += step) {
+        if (partition_range(total, world_size, i, alignment).size() > 0) {
+            return i;
         }
-        std::copy(key_str.begin(), key_str.end(), key);
-        // Initialize IV to zero or any other value
-        std::fill(iv, iv + 16, 0);
     }
+    return MPI_PROC_NULL;
+}
 
-    int encrypt_aes_cbc(const unsigned char* plaintext, int plaintext_len,
-        unsigned char* ciphertext 
-    ) {
-        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-        if (!ctx) return -1;
-        
-        int len, ciphertext_len;
+// Collects each rank's bytes on rank 0 of `comm` in rank order. An MPI_Gather of the
+// lengths sizes the result exactly, then a single MPI_Gatherv lets the MPI
+// library pick a tree or pipelined algorithm. Other ranks get an empty vector.
+std::vector<unsigned char> gather_to_root(const unsigned char* data, int len, int world_rank, int world_size,
+                                          MPI_Comm comm) {
+    std::vector<int> counts(world_rank == 0 ? world_size : 0);
+    MPI_Gather(&len, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, comm);
 
-        if (EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key, iv) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            return -1;
-        }
-        
-        if (EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, plaintext_len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            return -1;
-        }
-        ciphertext_len = len;
-        
-        if (EVP_EncryptFinal_ex(ctx, ciphertext + len, &len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            return -1;
+    std::vector<int> displs(counts.size());
+    std::vector<unsigned char> all_data;
+    if (world_rank == 0) {
+        size_t total = 0;
+        for (int i = 0; i < world_size; i++) {
+            displs[i] = total;
+            total += counts[i];
         }
-        ciphertext_len += len;
+        all_data.resize(total);
+    }
+
+    MPI_Gatherv(data, len, MPI_UNSIGNED_CHAR, all_data.data(), counts.data(), displs.data(),
+                MPI_UNSIGNED_CHAR, 0, comm);
+    return all_data;
+}
 
-        EVP_CIPHER_CTX_free(ctx);
-        return ciphertext_len;
+// Collective over `comm`: every rank passes the first error it ran into
+// (empty if none) and gets back the one of the lowest rank that has one, so
+// all ranks take the same way out of a job. Returns true if no rank failed.
+bool agree_on_error(std::string& error, MPI_Comm comm) {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    int first = error.empty() ? INT_MAX : rank;
+    MPI_Allreduce(MPI_IN_PLACE, &first, 1, MPI_INT, MPI_MIN, comm);
+    if (first == INT_MAX) {
+        return true;
     }
 
-    int encrypt_aes_ecb(const unsigned char* plaintext, int plaintext_len,
-                        unsigned char* ciphertext) {
-        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-        if (!ctx) return -1;
-        
-        int len;
-        int ciphertext_len;
+    unsigned long length = error.size();
+    MPI_Bcast(&length, 1, MPI_UNSIGNED_LONG, first, comm);
+    error.resize(length);
+    MPI_Bcast(&error[0], length, MPI_CHAR, first, comm);
+    return false;
+}
 
-        if (EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, key, NULL) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            return -1;
-        }
-        
-        if (EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, plaintext_len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            return -1;
+// A file mapped with mmap. Inputs are mapped read-only; outputs are sized with
+// ftruncate and mapped shared and writable, so the cipher reads from and writes
+// to the page cache directly. Empty files are not mapped (data() is null).
+class MappedFile {
+private:
+    int fd = -1;
+    unsigned char* map = nullptr;
+    size_t map_size = 0;
+
+public:
+    // Maps an existing file read-only.
+    explicit MappedFile(const std::string& path) {
+        fd = ::open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            release();
+            throw std::runtime_error("Error opening input file.");
         }
-        ciphertext_len = len;
-        
-        if (EVP_EncryptFinal_ex(ctx, ciphertext + len, &len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            return -1;
+        map_with(st.st_size, PROT_READ);
+    }
+
+    // Maps `size` bytes of an output file writable; `create` truncates the file
+    // (or creates it) and sizes it first.
+    MappedFile(const std::string& path, size_t size, bool create) {
+        fd = ::open(path.c_str(), create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+        if (fd < 0 || (create && ftruncate(fd, size) != 0)) {
+            release();
+            throw std::runtime_error("Error opening output file.");
         }
-        ciphertext_len += len;
+        map_with(size, PROT_READ | PROT_WRITE);
+    }
 
-        EVP_CIPHER_CTX_free(ctx);
-        return ciphertext_len;
+    ~MappedFile() {
+        release();
     }
 
-    int decrypt_aes_cbc(const unsigned char* ciphertext, int ciphertext_len,
-                        unsigned char* plaintext) {
-        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-        if (!ctx) return -1;
-        
-        int len;
-        int plaintext_len;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
 
-        if (EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key, iv) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            return -1;
-        }
-        
-        if (EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertext_len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            return -1;
+    unsigned char* data() const {
+        return map;
+    }
+
+    size_t size() const {
+        return map_size;
+    }
+
+    // Asks the kernel to start reading [offset, offset + len) ahead of use.
+    void prefetch(size_t offset, size_t len) const {
+        size_t page = offset / RANK_ALIGNMENT * RANK_ALIGNMENT;
+        if (map && len > 0) {
+            madvise(map + page, offset + len - page, MADV_WILLNEED);
         }
-        plaintext_len = len;
-        
-        if (EVP_DecryptFinal_ex(ctx, plaintext + len, &len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            return -1;
+    }
+
+    // Flushes written pages so other hosts on a shared volume see them.
+    void sync() const {
+        if (map && msync(map, map_size, MS_SYNC) != 0) {
+            throw std::runtime_error("Error writing output file.");
         }
-        plaintext_len += len;
+    }
 
-        EVP_CIPHER_CTX_free(ctx);
-        return plaintext_len;
+    // Cuts the file to its final length once all output is in place.
+    void truncate(size_t size) const {
+        if (ftruncate(fd, size) != 0) {
+            throw std::runtime_error("Error writing output file.");
+        }
     }
 
-    int decrypt_aes_ecb(const unsigned char* ciphertext, int ciphertext_len,
-                        unsigned char* plaintext) {
-        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-        if (!ctx) return -1;
-        
-        int len;
-        int plaintext_len;
+private:
+    void map_with(size_t size, int protection) {
+        map_size = size;
+        if (size == 0) {
+            return;
+        }
+        void* address = mmap(nullptr, size, protection, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED) {
+            release();
+            throw std::runtime_error("Failed to map file.");
+        }
+        map = static_cast<unsigned char*>(address);
+    }
 
-        if (EVP_DecryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, key, NULL) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            return -1;
+    void release() {
+        if (map) {
+            munmap(map, map_size);
+            map = nullptr;
         }
-        
-        if (EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertext_len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            return -1;
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
         }
-        plaintext_len = len;
-        
-        if (EVP_DecryptFinal_ex(ctx, plaintext + len, &len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            return -1;
+    }
+};
+
+// Window size used by --stream when no size is given.
+constexpr size_t DEFAULT_STREAM_WINDOW = 64 << 20;
+
+// Unit size used by --dynamic when no size is given, and the units a worker
+// has queued at least, so it has the next one while it reports the last.
+constexpr size_t DEFAULT_DYNAMIC_UNIT = 4 << 20;
+constexpr long long UNIT_PREFETCH = 2;
+
+// One file to process. The command line describes a single job; the daemon
+// started with --serve receives one per connection.
+struct Job {
+    std::string filename;
+    std::string operation;
+    std::string mode;
+    std::string key;
+};
+
+// Outcome of a job, the same on every rank that ran it: the output file, or
+// why the job failed.
+struct JobResult {
+    std::string output_file;
+    std::string error;
+};
+
+// How a job moves its data; see the option list in main().
+struct JobOptions {
+    bool use_mpi_io = false;
+    bool use_mmap = false;
+    size_t stream_window = 0;
+    size_t dynamic_unit = 0;
+    std::string weights_file;
+    int compress_level = 0;
+    bool trace = false;
+    std::string trace_file;
+};
+
+// Applies one command-line option. Returns false if it is not a valid one.
+bool parse_option(const std::string& option, JobOptions& options) {
+    try {
+        if (option == "--mpi-io") {
+            options.use_mpi_io = true;
+        } else if (option == "--mmap") {
+            options.use_mmap = true;
+        } else if (option == "--stream") {
+            options.stream_window = DEFAULT_STREAM_WINDOW;
+        } else if (option.rfind("--stream=", 0) == 0) {
+            options.stream_window = parse_size(option.substr(9));
+            return options.stream_window > 0;
+        } else if (option == "--dynamic") {
+            options.dynamic_unit = DEFAULT_DYNAMIC_UNIT;
+        } else if (option.rfind("--dynamic=", 0) == 0) {
+            options.dynamic_unit = parse_size(option.substr(10));
+            return options.dynamic_unit > 0;
+        } else if (option.rfind("--weights=", 0) == 0) {
+            options.weights_file = option.substr(10);
+            if (options.dynamic_unit == 0) {
+                options.dynamic_unit = DEFAULT_DYNAMIC_UNIT;
+            }
+            return !options.weights_file.empty();
+        } else if (option == "--compress") {
+            options.compress_level = ZBLOCK_DEFAULT_LEVEL;
+        } else if (option.rfind("--compress=", 0) == 0) {
+            options.compress_level = std::stoi(option.substr(11));
+            return options.compress_level >= 1 && options.compress_level <= 9;
+        } else if (option == "--trace") {
+            options.trace = true;
+        } else if (option.rfind("--trace=", 0) == 0) {
+            options.trace = true;
+            options.trace_file = option.substr(8);
+            return !options.trace_file.empty();
+        } else {
+            return false;
         }
-        plaintext_len += len;
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
 
-        EVP_CIPHER_CTX_free(ctx);
-        return plaintext_len;
+// Returns why a job cannot run, or an empty string if it can.
+std::string check_job(const Job& job) {
+    if (job.operation != "encrypt" && job.operation != "decrypt") {
+        return "Invalid operation. Use 'encrypt' or 'decrypt'.";
     }
-};
+    if (job.mode != "aes-128-cbc" && job.mode != "aes-128-ecb" && job.mode != "aes-128-ctr" &&
+        job.mode != "aes-128-cbc-seg" && job.mode != "aes-128-gcm") {
+        return "Invalid mode. Use 'aes-128-cbc', 'aes-128-ecb', 'aes-128-ctr', 'aes-128-cbc-seg' or 'aes-128-gcm'.";
+    }
+    return "";
+}
 
-int main(int argc, char** argv) {
-    /*
-        argv[1] = filename
-        argv[2] = encrypt/decrypt
-        argv[3] = aes-128-cbc/aes-128-ecb
-        argv[4] = key
-    */
-    if (argc < 5) {
-        std::cerr << "Usage: " << argv[0] << "mpirun -np <n> --host <hosts> executable_mpi <filename> <encrypt/decrypt> <aes-128-cbc/aes-128-ecb> <key>" << std::endl;
-        return -1;
+// Throughput per host in MB/s, as --dynamic jobs measured it, kept in a text
+// file of "<host> <MB/s>" lines. A missing file is an empty map.
+std::map<std::string, double> read_weights(const std::string& path) {
+    std::map<std::string, double> weights;
+    std::ifstream file(path);
+    std::string host;
+    double weight;
+    while (file >> host >> weight) {
+        if (weight > 0) {
+            weights[host] = weight;
+        }
     }
+    return weights;
+}
 
-    std::string filename = argv[1];
-    std::string operation = argv[2];
-    std::string mode = argv[3];
-    std::string key = argv[4];
-    std::string filename_without_extenstion = filename.substr(0, filename.find_last_of("."));
+bool write_weights(const std::string& path, const std::map<std::string, double>& weights) {
+    std::ofstream file(path);
+    for (const auto& entry : weights) {
+        file << entry.first << " " << entry.second << "\n";
+    }
+    return static_cast<bool>(file);
+}
 
-    if (operation != "encrypt" && operation != "decrypt") {
-        std::cerr << "Invalid operation. Use 'encrypt' or 'decrypt'." << std::endl;
-        return -1;
+// Per-phase timings of one job. Every rank records spans of its main thread
+// (and, with --trace, of the I/O helper and OpenMP threads) on its own clock,
+// counted from a barrier at the start of the job. report() reduces them into a
+// one-line summary on rank 0 and, with --trace, merges every rank's spans into
+// a Chrome/Perfetto trace file.
+class JobTrace {
+public:
+    enum Phase {
+        Read,
+        Broadcast,
+        Scatter,
+        Init,
+        Chain,
+        Compute,
+        Gather,
+        Write,
+        Finalize,
+        PHASE_COUNT,
+    };
+
+    // Tracks within a rank: the main thread, the asynchronous reader/writer,
+    // and OpenMP thread t at THREAD_TRACK + t.
+    static constexpr int MAIN_TRACK = 0;
+    static constexpr int IO_TRACK = 1;
+    static constexpr int THREAD_TRACK = 100;
+
+private:
+    struct Event {
+        int32_t rank;
+        int32_t phase;
+        int32_t track;
+        int32_t reserved;
+        double begin;
+        double end;
+        uint64_t bytes;
+    };
+
+    static const char* phase_name(int phase) {
+        static const char* names[PHASE_COUNT] = {"read", "broadcast", "scatter", "init", "chain",
+                                                 "compute", "gather", "write", "finalize"};
+        return names[phase];
     }
 
-    if (mode != "aes-128-cbc" && mode != "aes-128-ecb") {
-        std::cerr << "Invalid mode. Use 'aes-128-cbc' or 'aes-128-ecb'." << std::endl;
-        return -1;
+    MPI_Comm comm;
+    int rank;
+    int size;
+    double origin;
+    std::vector<Event> events;
+    std::mutex events_mutex;
+    std::unique_ptr<ThreadSpans> thread_spans;
+
+public:
+    JobTrace(MPI_Comm comm, bool detailed) : comm(comm) {
+        MPI_Comm_rank(comm, &rank);
+        MPI_Comm_size(comm, &size);
+        if (detailed) {
+            thread_spans.reset(new ThreadSpans(omp_get_max_threads()));
+            // a common starting point lines the ranks' clocks up
+            MPI_Barrier(comm);
+        }
+        origin = omp_get_wtime();
     }
 
-    MPI_Init(&argc, &argv);
+    // Seconds since the start of the job.
+    double now() const {
+        return omp_get_wtime() - origin;
+    }
+
+    // Records a span from `begin` until now. Safe to call from any thread.
+    void add(Phase phase, double begin, int track = MAIN_TRACK, size_t bytes = 0) {
+        double end = now();
+        std::lock_guard<std::mutex> lock(events_mutex);
+        events.push_back({rank, phase, track, 0, begin, end, bytes});
+    }
+
+    // Where the cipher records its threads' work, or nullptr without --trace.
+    ThreadSpans* spans() {
+        return thread_spans.get();
+    }
+
+    // Collective over the job's ranks. Main-thread spans count with their
+    // own time only (a span nested inside another is taken out of the outer
+    // one); each phase is reported for the rank where it took longest.
+    void report(const std::string& trace_file) {
+        std::vector<Event> main_events;
+        for (const Event& event : events) {
+            if (event.track == MAIN_TRACK) {
+                main_events.push_back(event);
+            }
+        }
+        std::sort(main_events.begin(), main_events.end(), [](const Event& a, const Event& b) {
+            return a.begin < b.begin || (a.begin == b.begin && a.end > b.end);
+        });
+
+        double totals[PHASE_COUNT + 1] = {};
+        std::vector<const Event*> open;
+        for (const Event& event : main_events) {
+            while (!open.empty() && open.back()->end <= event.begin) {
+                open.pop_back();
+            }
+            if (!open.empty()) {
+                totals[open.back()->phase] -= event.end - event.begin;
+            }
+            totals[event.phase] += event.end - event.begin;
+            open.push_back(&event);
+        }
+        totals[PHASE_COUNT] = now();
+
+        double slowest[PHASE_COUNT + 1];
+        MPI_Reduce(totals, slowest, PHASE_COUNT + 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+        if (rank == 0) {
+            double io = slowest[Read] + slowest[Write];
+            double communication = slowest[Broadcast] + slowest[Scatter] + slowest[Chain] + slowest[Gather];
+            double compute = slowest[Init] + slowest[Compute];
+            const char* bound = io >= communication && io >= compute ? "I/O"
+                : communication >= compute ? "communication" : "compute";
+
+            std::ostringstream line;
+            line << "Rank 0: Phase times (s, slowest rank):";
+            for (int phase = 0; phase < PHASE_COUNT; phase++) {
+                line << " " << phase_name(phase) << "=" << slowest[phase];
+            }
+            line << " total=" << slowest[PHASE_COUNT] << " -> " << bound << "-bound.";
+            std::cout << line.str() << std::endl;
+        }
+
+        if (thread_spans) {
+            write_trace(trace_file);
+        }
+    }
+
+private:
+    void write_trace(const std::string& trace_file) {
+        std::vector<Event> all = events;
+        for (int thread = 0; thread < thread_spans->thread_count(); thread++) {
+            for (const ThreadSpans::Span& span : thread_spans->of(thread)) {
+                all.push_back({rank, Compute, THREAD_TRACK + thread, 0, span.begin - origin, span.end - origin,
+                               span.bytes});
+            }
+        }
+        std::vector<unsigned char> merged = gather_to_root(reinterpret_cast<const unsigned char*>(all.data()),
+                                                           all.size() * sizeof(Event), rank, size, comm);
+
+        char hostname[HOST_NAME_MAX] = {};
+        gethostname(hostname, HOST_NAME_MAX - 1);
+        std::vector<char> hostnames(rank == 0 ? size * HOST_NAME_MAX : 0);
+        MPI_Gather(hostname, HOST_NAME_MAX, MPI_CHAR, hostnames.data(), HOST_NAME_MAX, MPI_CHAR, 0, comm);
+        if (rank != 0) {
+            return;
+        }
 
+        std::ofstream out(trace_file);
+        out << "{\"traceEvents\": [\n";
+        for (int r = 0; r < size; r++) {
+            out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << r
+                << ", \"args\": {\"name\": \"rank " << r << " (" << &hostnames[r * HOST_NAME_MAX] << ")\"}},\n";
+        }
+        const Event* merged_events = reinterpret_cast<const Event*>(merged.data());
+        size_t count = merged.size() / sizeof(Event);
+        for (size_t i = 0; i < count; i++) {
+            const Event& event = merged_events[i];
+            out << "{\"name\": \"" << phase_name(event.phase) << "\", \"ph\": \"X\", \"pid\": " << event.rank
+                << ", \"tid\": " << event.track << ", \"ts\": " << event.begin * 1e6
+                << ", \"dur\": " << (event.end - event.begin) * 1e6 << ", \"args\": {\"bytes\": " << event.bytes
+                << "}},\n";
+        }
+        // thread names close the list, so no event needs a trailing comma rule
+        for (int r = 0; r < size; r++) {
+            out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << r << ", \"tid\": " << MAIN_TRACK
+                << ", \"args\": {\"name\": \"main\"}},\n";
+            for (int thread = 0; thread < thread_spans->thread_count(); thread++) {
+                out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << r << ", \"tid\": "
+                    << THREAD_TRACK + thread << ", \"args\": {\"name\": \"omp " << thread << "\"}},\n";
+            }
+            out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << r << ", \"tid\": " << IO_TRACK
+                << ", \"args\": {\"name\": \"io\"}}" << (r + 1 < size ? "," : "") << "\n";
+        }
+        out << "]}\n";
+        if (!out) {
+            std::cerr << "Error writing trace file " << trace_file << "." << std::endl;
+            return;
+        }
+        std::cout << "Rank 0: Wrote trace of " << count << " spans to " << trace_file << "." << std::endl;
+    }
+};
+
+// Encrypts or decrypts one file on the ranks of `comm`. An error that a job
+// can run into, such as a missing file, a wrong key or a segment that fails
+// authentication, does not abort: the rank that hits it keeps taking part in
+// the collectives, and the ranks agree on the outcome at a few checkpoints.
+// `packed_input`, if given, is the --compress stream to transform in place of
+// the file's contents; it is needed on the ranks that would read the file
+// (every rank with --mpi-io, rank 0 otherwise). The output is still named
+// after the file.
+JobResult transform_job(const Job& job, const JobOptions& options, MPI_Comm comm,
+                        const ZBlockStream* packed_input = nullptr) {
     int world_size;
-    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+    MPI_Comm_size(comm, &world_size);
 
     int world_rank;
-    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    MPI_Comm_rank(comm, &world_rank);
 
-    char hostname[HOST_NAME_MAX];
-    gethostname(hostname, HOST_NAME_MAX);
+    JobTrace trace(comm, options.trace);
 
-    std::cout << "Hello from process " << world_rank << " of " << world_size 
-              << " running on container: " << hostname << std::endl;
+    const std::string& filename = job.filename;
+    const std::string& operation = job.operation;
+    const std::string& mode = job.mode;
+    const std::string& key = job.key;
+    std::string filename_without_extenstion = filename.substr(0, filename.find_last_of("."));
+    bool use_mpi_io = options.use_mpi_io;
+    bool use_mmap = options.use_mmap;
+    size_t stream_window = options.stream_window;
+
+    // The output is written under a temporary name and only gets its own once
+    // every rank has finished the job, so a job that fails (a GCM segment that
+    // does not authenticate, say) never leaves its output under that name.
+    std::string output_file_name = filename_without_extenstion
+        + (operation == "encrypt" ? "_output.bin" : "_outputdecrypted.bmp");
+    std::string partial_file_name = output_file_name + ".part";
 
-    std::vector<char> buffer;
     size_t total_size = 0;
+    MPI_File input_fh = MPI_FILE_NULL;
+    MPI_File output_fh = MPI_FILE_NULL;
+    std::ifstream input_file;
+    std::unique_ptr<MappedFile> input_map;
 
-    // only rank 0(c03) reads the file
-    if (world_rank == 0) {
-        std::ifstream input_file(filename, std::ios::binary);
+    // the first error this rank ran into; see agree_on_error()
+    std::string error;
+    auto note_error = [&](const std::string& message) {
+        if (error.empty()) {
+            error = message;
+        }
+    };
+    // gives up on the job once every rank knows the error
+    auto fail_job = [&]() {
+        if (input_fh != MPI_FILE_NULL) {
+            MPI_File_close(&input_fh);
+        }
+        if (output_fh != MPI_FILE_NULL) {
+            MPI_File_close(&output_fh);
+        }
+        if (world_rank == 0) {
+            std::remove(partial_file_name.c_str());
+        }
+        return JobResult{"", error};
+    };
+
+    // with --mmap the ranks that do file I/O map the files instead
+    bool maps_files = use_mmap && (use_mpi_io || world_rank == 0);
+    if (packed_input) {
+        total_size = packed_input->size();
+    } else if (maps_files) {
+        try {
+            input_map.reset(new MappedFile(filename));
+            total_size = input_map->size();
+            if (world_rank == 0) {
+                std::cout << "Rank 0: Mapped file of size " << total_size << " bytes." << std::endl;
+            }
+        } catch (const std::exception& e) {
+            note_error(e.what());
+        }
+    } else if (use_mpi_io) {
+        // the input sits on a shared volume: every rank reads its own range below
+        if (MPI_File_open(comm, filename.c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &input_fh) != MPI_SUCCESS) {
+            note_error("Error opening input file.");
+        } else {
+            MPI_Offset file_size;
+            MPI_File_get_size(input_fh, &file_size);
+            total_size = file_size;
+        }
+    } else if (world_rank == 0) {
+        // only rank 0(c03) reads the file
+        input_file.open(filename, std::ios::binary);
         if (!input_file) {
-            std::cerr << "Error opening input file." << std::endl;
-            MPI_Abort(MPI_COMM_WORLD, 1);
+            note_error("Error opening input file.");
+        } else {
+            input_file.seekg(0, std::ios::end);
+            total_size = input_file.tellg();
+            input_file.seekg(0, std::ios::beg);
+
+            std::cout << "Rank 0: Reading file of size " << total_size << " bytes." << std::endl;
+        }
+    }
+    if (!agree_on_error(error, comm)) {
+        return fail_job();
+    }
+
+    double phase_begin = trace.now();
+    MPI_Bcast(&total_size, 1, MPI_UNSIGNED_LONG, 0, comm);
+    trace.add(JobTrace::Broadcast, phase_begin);
+
+    // read `len` bytes at `offset` from the input, on whichever rank holds it
+    auto read_input = [&](size_t offset, void* out, size_t len) {
+        if (packed_input) {
+            packed_input->read(offset, static_cast<unsigned char*>(out), len);
+        } else if (input_map) {
+            std::copy(input_map->data() + offset, input_map->data() + offset + len, static_cast<unsigned char*>(out));
+        } else if (use_mpi_io) {
+            MPI_File_read_at(input_fh, offset, out, len, MPI_CHAR, MPI_STATUS_IGNORE);
+        } else {
+            input_file.seekg(offset);
+            input_file.read(static_cast<char*>(out), len);
         }
+    };
 
-        input_file.seekg(0, std::ios::end);
-        total_size = input_file.tellg();
-        input_file.seekg(0, std::ios::beg);
-        
-        buffer.resize(total_size);
-        input_file.read(buffer.data(), total_size);
-        input_file.close();
+    // A segmented container is decrypted segment by segment: rank 0 reads the
+    // header and the table (or GCM tags) and every rank gets a copy.
+    bool segmented = mode == "aes-128-cbc-seg" || mode == "aes-128-gcm";
+    SegmentedContainer container;
+    container.gcm = mode == "aes-128-gcm";
+    if (segmented && operation == "decrypt") {
+        std::vector<unsigned char> layout;
+        if (world_rank == 0) {
+            phase_begin = trace.now();
+            layout = container.read_layout(read_input, total_size);
+            trace.add(JobTrace::Read, phase_begin, JobTrace::MAIN_TRACK, layout.size());
+            if (!container.parse(layout.data(), layout.size(), total_size)) {
+                note_error(std::string("Input is not a valid ") + (container.gcm ? "AES-GCM" : "segmented CBC") +
+                           " container.");
+            }
+        }
 
-        std::cout << "Rank 0: Read file of size " << total_size << " bytes." << std::endl;
+        phase_begin = trace.now();
+        unsigned long layout_size = layout.size();
+        MPI_Bcast(&layout_size, 1, MPI_UNSIGNED_LONG, 0, comm);
+        layout.resize(layout_size);
+        MPI_Bcast(layout.data(), layout_size, MPI_UNSIGNED_CHAR, 0, comm);
+        trace.add(JobTrace::Broadcast, phase_begin);
+        if (world_rank != 0) {
+            container.parse(layout.data(), layout_size, total_size);
+        }
     }
 
-    MPI_Bcast(&total_size, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
+    // CTR files start with their random initial counter block; it is drawn
+    // on rank 0 or read back from the file and every rank gets a copy
+    bool ctr = mode == "aes-128-ctr";
+    unsigned char counter_iv[AES_BLOCK_SIZE] = {};
+    if (ctr && world_rank == 0) {
+        if (operation == "encrypt" && RAND_bytes(counter_iv, AES_BLOCK_SIZE) != 1) {
+            note_error("Failed to generate the CTR initial counter block.");
+        }
+        if (operation == "decrypt" && total_size < CTR_HEADER_SIZE) {
+            note_error("Input is not a valid AES-CTR file.");
+        } else if (operation == "decrypt") {
+            phase_begin = trace.now();
+            read_input(0, counter_iv, CTR_HEADER_SIZE);
+            trace.add(JobTrace::Read, phase_begin, JobTrace::MAIN_TRACK, CTR_HEADER_SIZE);
+        }
+    }
+    if (ctr) {
+        phase_begin = trace.now();
+        MPI_Bcast(counter_iv, AES_BLOCK_SIZE, MPI_UNSIGNED_CHAR, 0, comm);
+        trace.add(JobTrace::Broadcast, phase_begin);
+    }
 
-    size_t chunk_size = total_size / world_size;
-    size_t remainder = total_size % world_size;
-    
-    size_t my_chunk_size = chunk_size;
-    if (world_rank == world_size - 1) {
-        my_chunk_size += remainder;
+    // every rank authenticates the GCM header with its segments, so its nonce
+    // prefix has to be settled before any of them is sealed
+    if (container.gcm && operation == "encrypt") {
+        if (world_rank == 0 && RAND_bytes(container.nonce_prefix, SegmentedContainer::NONCE_PREFIX_SIZE) != 1) {
+            note_error("Failed to generate the GCM nonce prefix.");
+        }
+        phase_begin = trace.now();
+        MPI_Bcast(container.nonce_prefix, SegmentedContainer::NONCE_PREFIX_SIZE, MPI_UNSIGNED_CHAR, 0, comm);
+        trace.add(JobTrace::Broadcast, phase_begin);
+    }
+    if (!agree_on_error(error, comm)) {
+        return fail_job();
     }
 
-    std::vector<char> my_chunk(my_chunk_size);
-    if (world_rank == 0) {
-        size_t offset = 0;
-        for (size_t i = 0; i < world_size; i++) {
-            size_t send_size = chunk_size;
-            if (i == world_size - 1) {
-                send_size += remainder;
-            }
+    // The job is a stream of bytes (when decrypting, the container data of a
+    // segmented file or what follows the counter block of a CTR file) cut into
+    // windows; every window is split across ranks on `alignment` boundaries.
+    // Without --stream there is a single window unless the file is larger than
+    // MAX_WINDOW_SIZE. Output offsets follow input offsets, as only the end of
+    // the stream changes size.
+    size_t stream_begin = 0;
+    if (operation == "decrypt") {
+        stream_begin = segmented ? container.data_offset() : ctr ? CTR_HEADER_SIZE : 0;
+    }
+    size_t stream_len = total_size - stream_begin - (operation == "decrypt" ? container.trailer_size() : 0);
+    size_t alignment = segmented ? container.segment_size : RANK_ALIGNMENT;
+    if (alignment > MAX_WINDOW_SIZE) {
+        note_error("Segment size of the container is too large.");
+        return fail_job();
+    }
+    // checked for the whole stream up front, so no rank's piece fails on it
+    if (operation == "decrypt" && (mode == "aes-128-ecb" || mode == "aes-128-cbc") &&
+        (stream_len == 0 || stream_len % AES_BLOCK_SIZE != 0)) {
+        note_error("Ciphertext length is not a multiple of the AES block size.");
+        return fail_job();
+    }
+    size_t window_bytes = std::min(stream_window > 0 ? stream_window : stream_len, MAX_WINDOW_SIZE);
+    size_t window_units = std::max<size_t>(1, window_bytes / alignment);
+    size_t window_size = window_units * alignment;
+    size_t num_windows = std::max<size_t>(1, (stream_len / alignment + window_units - 1) / window_units);
+    bool is_last_rank = world_rank == world_size - 1;
 
-            if (i == 0) {
-                std::copy(buffer.begin(), buffer.begin() + send_size, my_chunk.begin());
-            } else {
-                MPI_Send(buffer.data() + offset, send_size, MPI_CHAR, i, 0, MPI_COMM_WORLD);
-            }
-            offset += send_size;
+    // With --dynamic the stream is cut into units instead, which rank 0 deals
+    // out on demand. CBC encryption is one chain across the ranks and keeps
+    // the static split.
+    bool dynamic = options.dynamic_unit > 0;
+    if (dynamic && mode == "aes-128-cbc" && operation == "encrypt") {
+        dynamic = false;
+        if (world_rank == 0) {
+            std::cout << "Rank 0: CBC encryption is a single chain, --dynamic is ignored." << std::endl;
         }
-    } else {
-        MPI_Recv(my_chunk.data(), my_chunk_size, MPI_CHAR, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
     }
+    size_t unit_size = std::max(alignment, std::min(options.dynamic_unit, MAX_WINDOW_SIZE) / alignment * alignment);
+    // as with windows, the sub-alignment tail of the stream (the padding
+    // block of a segmented container) rides with the last unit
+    long long num_units = std::max<size_t>(1, (stream_len / alignment * alignment + unit_size - 1) / unit_size);
+    auto unit_range = [&](long long u) {
+        return Range{u * unit_size, u + 1 == num_units ? stream_len : (u + 1) * unit_size};
+    };
+    // CBC decryption of a unit needs the ciphertext block in front of it
+    auto unit_prefix = [&](const Range& range) -> size_t {
+        return mode == "aes-128-cbc" && range.begin > 0 ? AES_BLOCK_SIZE : 0;
+    };
 
-    std::cout << "Process " << world_rank << " recieved chunk of size " 
-              << my_chunk_size << " bytes." << std::endl;
+    // the sub-alignment tail of the stream rides with the last window
+    auto window_range = [&](size_t w) {
+        return Range{w * window_size, w + 1 == num_windows ? stream_len : (w + 1) * window_size};
+    };
+    auto piece_range = [&](size_t w, int rank) {
+        Range window = window_range(w);
+        Range piece = partition_range(window.size(), world_size, rank, alignment);
+        return Range{window.begin + piece.begin, window.begin + piece.end};
+    };
+
+    long long layout_len = ctr && operation == "encrypt" ? CTR_HEADER_SIZE : 0;
+    long long trailer_len = 0;
+    if (segmented && operation == "encrypt") {
+        container.plaintext_size = total_size;
+        layout_len = SegmentedContainer::HEADER_SIZE
+            + SegmentedContainer::segment_count(total_size, SEGMENT_SIZE) * SegmentedContainer::ENTRY_SIZE;
+    }
+    if (container.gcm && operation == "encrypt") {
+        layout_len = container.header_size();
+        trailer_len = container.trailer_size();
+    }
 
     try {
+        phase_begin = trace.now();
         AESCipher cipher(key);
+        if (ctr) {
+            cipher.set_iv(counter_iv);
+        }
+        StreamTransformer transformer(cipher, operation, mode, container);
+        transformer.record_spans(trace.spans());
+        trace.add(JobTrace::Init, phase_begin);
         double start_time = MPI_Wtime();
-        
-        if (operation == "encrypt") {
-            if (mode == "aes-128-cbc") {
-                std::vector<unsigned char> encrypted_chunk(my_chunk_size + AES_BLOCK_SIZE);
-        
-                int encrypted_len = cipher.encrypt_aes_cbc(reinterpret_cast<const unsigned char*>(my_chunk.data()),
-                                                            my_chunk_size, encrypted_chunk.data()
-                                                        );
-                if (encrypted_len < 0) {
-                    throw std::runtime_error("Encryption failed in AES-CBC mode.");
-                }
 
+        std::ofstream output_file;
+        std::unique_ptr<MappedFile> output_map;
+        if (maps_files) {
+            // Rank 0 sizes the file for the largest possible output (padding
+            // included) and cuts it back at the end; the other ranks of an
+            // --mpi-io run map it once it exists.
+            size_t capacity = layout_len + stream_len + AES_BLOCK_SIZE + trailer_len;
+            try {
                 if (world_rank == 0) {
-                    std::vector<unsigned char> all_encrypted_data;
-                    all_encrypted_data.insert(all_encrypted_data.end(), encrypted_chunk.begin(), encrypted_chunk.begin() + encrypted_len);
+                    output_map.reset(new MappedFile(partial_file_name, capacity, true));
+                }
+            } catch (const std::exception& e) {
+                note_error(e.what());
+            }
+            if (use_mpi_io) {
+                MPI_Barrier(comm);
+                try {
+                    if (world_rank != 0) {
+                        output_map.reset(new MappedFile(partial_file_name, capacity, false));
+                    }
+                } catch (const std::exception& e) {
+                    note_error(e.what());
+                }
+            }
+        } else if (use_mpi_io) {
+            if (MPI_File_open(comm, partial_file_name.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                              MPI_INFO_NULL, &output_fh) != MPI_SUCCESS) {
+                note_error("Error opening output file.");
+            } else {
+                MPI_File_set_size(output_fh, 0);
+            }
+        } else if (world_rank == 0) {
+            output_file.open(partial_file_name, std::ios::binary);
+            if (!output_file) {
+                note_error("Error opening output file.");
+            }
+            // the segment table is only complete at the end; reserve its place
+            std::vector<char> placeholder(layout_len);
+            output_file.write(placeholder.data(), placeholder.size());
+        }
+        if (!agree_on_error(error, comm)) {
+            return fail_job();
+        }
 
-                    for (int i = 1; i < world_size; i++) {
-                        int recv_encrypted_len;
-                        MPI_Recv(&recv_encrypted_len, 1, MPI_INT, i, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        // A piece that does not transform (a wrong key, a GCM segment that
+        // fails authentication) fails the job once it is over: the rank keeps
+        // its place in the collectives with output of the piece's length,
+        // which is never kept.
+        auto transform_piece = [&](const unsigned char* input, size_t len, uint64_t offset, bool stream_end,
+                                   const unsigned char* previous_block, unsigned char* output,
+                                   std::vector<SegmentEntry>& entries) -> long long {
+            try {
+                return transformer.transform(input, len, offset, stream_end, previous_block, output, entries);
+            } catch (const std::exception& e) {
+                note_error(e.what());
+                return len;
+            }
+        };
 
-                        std::vector<unsigned char> recv_encrypted(recv_encrypted_len);
-                        MPI_Recv(recv_encrypted.data(), recv_encrypted_len, MPI_UNSIGNED_CHAR, i, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                        
-                        std::cout << "Rank 0 received encrypted data from rank " << i 
-                                << " of size " << recv_encrypted_len << " bytes." << std::endl;
-                        all_encrypted_data.insert(all_encrypted_data.end(), recv_encrypted.begin(), recv_encrypted.end());
-                    }
+        // Double buffering: window w+1 is read and window w-1 written while
+        // window w is transformed, so peak memory is a few windows. The
+        // buffers come from the huge-page arena and are never zero-filled;
+        // what the threads encrypt is first touched by them, see PoolBuffer.
+        PoolBuffer window_buffer[2];
+        PoolBuffer my_input[2];
+        PoolBuffer my_output[2];
+        PoolBuffer gathered[2];
 
-                    std::string output_file_name = filename_without_extenstion + "_output.bin";
-                    std::ofstream output_file(output_file_name, std::ios::binary);
-                    output_file.write(reinterpret_cast<const char*>(all_encrypted_data.data()), all_encrypted_data.size());
-                    output_file.close();
+        // ECB, CTR and CBC decryption overwrite the piece they read instead of
+        // filling a second buffer; not when either side is a file mapping, and
+        // not on a collecting rank 0, which writes straight into the window
+        bool in_place = !input_map && !output_map &&
+            (mode == "aes-128-ecb" || mode == "aes-128-ctr" || (mode == "aes-128-cbc" && operation == "decrypt"));
+        std::future<void> pending_read, pending_write;
+        MPI_Request read_request[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+        MPI_Request write_request[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+        MPI_Request gather_request[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+        long long output_len = 0;
 
-                    std::cout << "Rank 0: Wrote encrypted data to " << output_file_name 
-                            << " of size " << all_encrypted_data.size() << " bytes." << std::endl;
-                } else {
-                    MPI_Send(&encrypted_len, 1, MPI_INT, 0, 2, MPI_COMM_WORLD);
-                    MPI_Send(encrypted_chunk.data(), encrypted_len, MPI_UNSIGNED_CHAR, 0, 1, MPI_COMM_WORLD);
+        // CBC carries the last ciphertext block from the end of one window to
+        // the start of the next one
+        unsigned char carry_block[AES_BLOCK_SIZE];
+        MPI_Request carry_request = MPI_REQUEST_NULL;
+
+        // Without MPI-IO rank 0 collects each window: every piece's offset is
+        // known from the partition and only the piece at the end of the stream
+        // changes length (by its padding), so a receive for every other rank is
+        // posted up front straight at the piece's final place, in the output
+        // mapping or in gathered[slot].
+        std::vector<MPI_Request> receive_requests[2];
+        long long window_len[2] = {0, 0};
+
+        auto post_receives = [&](size_t w, unsigned char* window_output) {
+            int slot = w % 2;
+            Range window = window_range(w);
+            for (int i = 1; i < world_size; i++) {
+                Range range = piece_range(w, i);
+                bool stream_end = i == world_size - 1 && w + 1 == num_windows;
+                if (range.size() == 0 && !stream_end) {
+                    continue;
                 }
-            } else if (mode == "aes-128-ecb") {
-                std::vector<unsigned char> encrypted_chunk(my_chunk_size + AES_BLOCK_SIZE);
+                size_t capacity = range.size() + (stream_end ? AES_BLOCK_SIZE : 0);
+                receive_requests[slot].push_back(MPI_REQUEST_NULL);
+                MPI_Irecv(window_output + (range.begin - window.begin), capacity, MPI_UNSIGNED_CHAR, i, 7, comm,
+                          &receive_requests[slot].back());
+            }
+        };
 
-                int num_blocks = my_chunk_size / AES_BLOCK_SIZE;
-                int remaining_bytes = my_chunk_size % AES_BLOCK_SIZE;
+        // Waits for the rest of the window in `slot` and hands it to the writer.
+        auto finish_window = [&](int slot) {
+            double begin = trace.now();
+            std::vector<MPI_Status> statuses(receive_requests[slot].size());
+            MPI_Waitall(receive_requests[slot].size(), receive_requests[slot].data(), statuses.data());
+            receive_requests[slot].clear();
+            long long len = window_len[slot];
+            for (MPI_Status& status : statuses) {
+                int count = 0;
+                MPI_Get_count(&status, MPI_UNSIGNED_CHAR, &count);
+                len += count;
+            }
+            output_len += len;
+            trace.add(JobTrace::Gather, begin);
+            if (output_map) {
+                return;
+            }
+
+            // the writer drains one window at a time, in order
+            if (pending_write.valid()) {
+                begin = trace.now();
+                pending_write.get();
+                trace.add(JobTrace::Write, begin);
+            }
+            pending_write = std::async(std::launch::async, [&, slot, len]() {
+                double write_begin = trace.now();
+                output_file.write(reinterpret_cast<const char*>(gathered[slot].data()), len);
+                trace.add(JobTrace::Write, write_begin, JobTrace::IO_TRACK, len);
+            });
+        };
+
+        // writes output at `offset` of the file, for the ranks that write their own
+        auto write_output = [&](size_t offset, const unsigned char* data, size_t len) {
+            double begin = trace.now();
+            if (use_mpi_io) {
+                MPI_File_write_at(output_fh, offset, data, len, MPI_UNSIGNED_CHAR, MPI_STATUS_IGNORE);
+            } else {
+                output_file.seekp(offset);
+                output_file.write(reinterpret_cast<const char*>(data), len);
+            }
+            trace.add(JobTrace::Write, begin, JobTrace::MAIN_TRACK, len);
+        };
+
+        // --dynamic: the ranks pull units instead of being handed a fixed
+        // share, so a rank slowed down by other work just does fewer of them.
+        // Every worker has UNIT_PREFETCH units queued (more with --weights, in
+        // proportion to its host's throughput in earlier jobs), and each
+        // result it sends back earns it the next unit. Rank 0 answers waiting
+        // workers before it takes a unit itself. A unit's output lands at the
+        // offset of its input, as with the windows. Without MPI-IO rank 0
+        // ships the units and writes the results; with it every rank does its
+        // own I/O and only the unit numbers travel.
+        double units_elapsed = 0;
+        auto run_units = [&]() {
+            bool ships_data = !use_mpi_io;
+            double units_begin = MPI_Wtime();
+            double busy = 0;
+            double my_units = 0;
+            double my_bytes = 0;
+
+            // `input` starts with the unit's prefix
+            auto transform_unit = [&](const Range& range, const unsigned char* input, unsigned char* output,
+                                      std::vector<SegmentEntry>& entries) {
+                size_t prefix = unit_prefix(range);
+                double begin = trace.now();
+                long long len = transform_piece(input + prefix, range.size(), range.begin, range.end == stream_len,
+                                                prefix > 0 ? input : cipher.get_iv(), output, entries);
+                trace.add(JobTrace::Compute, begin, JobTrace::MAIN_TRACK, range.size());
+                busy += trace.now() - begin;
+                my_units++;
+                my_bytes += range.size();
+                return len;
+            };
+
+            char host[MPI_MAX_PROCESSOR_NAME] = {};
+            int host_len = 0;
+            MPI_Get_processor_name(host, &host_len);
+            std::vector<unsigned char> hosts = gather_to_root(reinterpret_cast<unsigned char*>(host), MPI_MAX_PROCESSOR_NAME,
+                                                              world_rank, world_size, comm);
+            auto host_of = [&](int rank) {
+                return std::string(reinterpret_cast<const char*>(hosts.data()) + rank * MPI_MAX_PROCESSOR_NAME);
+            };
+
+            if (world_rank == 0) {
+                std::map<std::string, double> weights;
+                if (!options.weights_file.empty()) {
+                    weights = read_weights(options.weights_file);
+                }
+
+                // Half of the units go out up front in proportion to the
+                // weights; ranks on hosts without one count as average.
+                std::vector<long long> seed(world_size, UNIT_PREFETCH);
+                std::vector<double> rank_weight(world_size, 0);
+                double known = 0;
+                int known_ranks = 0;
+                for (int i = 0; i < world_size; i++) {
+                    auto it = weights.find(host_of(i));
+                    if (it != weights.end()) {
+                        rank_weight[i] = it->second;
+                        known += it->second;
+                        known_ranks++;
+                    }
+                }
+                if (known_ranks > 0) {
+                    double total = 0;
+                    for (int i = 0; i < world_size; i++) {
+                        rank_weight[i] = rank_weight[i] > 0 ? rank_weight[i] : known / known_ranks;
+                        total += rank_weight[i];
+                    }
+                    for (int i = 1; i < world_size; i++) {
+                        seed[i] = std::max(UNIT_PREFETCH, std::llround(num_units / 2.0 * rank_weight[i] / total));
+                    }
+                }
 
-                int encrypted_len = 0;
+                if (segmented && operation == "encrypt") {
+                    container.segments.resize(SegmentedContainer::segment_count(total_size, SEGMENT_SIZE));
+                }
+                auto store_entries = [&](const Range& range, const SegmentEntry* entries, size_t count) {
+                    std::copy(entries, entries + count, container.segments.begin() + range.begin / container.segment_size);
+                };
 
-                #pragma omp parallel for reduction(+:encrypted_len)
-                for (int block = 0; block < num_blocks; block++) {
-                    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-                    if (ctx) {
-                        int len;
-                        if (EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, reinterpret_cast<const unsigned char*>(key.c_str()), NULL) == 1) {
-                            EVP_CIPHER_CTX_set_padding(ctx, 0);
+                // A unit number (-1 to stop) and, when rank 0 ships the data,
+                // the unit itself on its way to a worker. The buffer is kept
+                // until both sends complete.
+                struct Dispatch {
+                    long long index;
+                    PoolBuffer data;
+                    MPI_Request requests[2];
+                };
+                std::list<Dispatch> dispatches;
+                std::vector<std::deque<long long>> queued(world_size);
+                long long next_unit = 0;
+                long long outstanding = 0;
 
-                            const unsigned char* input = reinterpret_cast<const unsigned char*>(my_chunk.data() + block * AES_BLOCK_SIZE);
-                            unsigned char* output = encrypted_chunk.data() + block * AES_BLOCK_SIZE;
+                auto send_unit = [&](int rank) {
+                    dispatches.emplace_back();
+                    Dispatch& dispatch = dispatches.back();
+                    dispatch.index = next_unit < num_units ? next_unit++ : -1;
+                    dispatch.requests[1] = MPI_REQUEST_NULL;
+                    MPI_Isend(&dispatch.index, 1, MPI_LONG_LONG, rank, 8, comm, &dispatch.requests[0]);
+                    if (dispatch.index >= 0) {
+                        queued[rank].push_back(dispatch.index);
+                        outstanding++;
+                    }
+                    if (!ships_data) {
+                        return;
+                    }
 
-                            if (EVP_EncryptUpdate(ctx, output, &len, input, AES_BLOCK_SIZE) == 1) {
-                                #pragma omp atomic
-                                encrypted_len += len;
-                            }
+                    const unsigned char* data = nullptr;
+                    size_t len = 0;
+                    if (dispatch.index >= 0) {
+                        Range range = unit_range(dispatch.index);
+                        size_t offset = stream_begin + range.begin - unit_prefix(range);
+                        len = unit_prefix(range) + range.size();
+                        if (input_map) {
+                            data = input_map->data() + offset;
+                        } else {
+                            double begin = trace.now();
+                            dispatch.data.resize(len, 0);
+                            read_input(offset, dispatch.data.data(), len);
+                            trace.add(JobTrace::Read, begin, JobTrace::MAIN_TRACK, len);
+                            data = dispatch.data.data();
                         }
-                        EVP_CIPHER_CTX_free(ctx);
+                    }
+                    MPI_Isend(data, len, MPI_UNSIGNED_CHAR, rank, 11, comm, &dispatch.requests[1]);
+                };
+
+                // drops the dispatches whose sends are done
+                auto reap = [&]() {
+                    for (auto it = dispatches.begin(); it != dispatches.end();) {
+                        int done = 0;
+                        MPI_Testall(2, it->requests, &done, MPI_STATUSES_IGNORE);
+                        it = done ? dispatches.erase(it) : std::next(it);
+                    }
+                };
+
+                // a worker's results come back in the order it was given the units
+                PoolBuffer result;
+                auto collect = [&](int rank) {
+                    long long index = queued[rank].front();
+                    queued[rank].pop_front();
+                    outstanding--;
+                    Range range = unit_range(index);
+
+                    unsigned char* destination = nullptr;
+                    size_t capacity = 0;
+                    if (ships_data) {
+                        capacity = range.size() + AES_BLOCK_SIZE;
+                        if (output_map) {
+                            destination = output_map->data() + layout_len + range.begin;
+                        } else {
+                            result.resize(capacity, 0);
+                            destination = result.data();
+                        }
+                    }
+                    double begin = trace.now();
+                    MPI_Status status;
+                    int len = 0;
+                    MPI_Recv(destination, capacity, MPI_UNSIGNED_CHAR, rank, 9, comm, &status);
+                    MPI_Get_count(&status, MPI_UNSIGNED_CHAR, &len);
+                    if (segmented && operation == "encrypt") {
+                        int table_len = 0;
+                        MPI_Probe(rank, 10, comm, &status);
+                        MPI_Get_count(&status, MPI_UNSIGNED_CHAR, &table_len);
+                        std::vector<unsigned char> table(table_len);
+                        MPI_Recv(table.data(), table_len, MPI_UNSIGNED_CHAR, rank, 10, comm, MPI_STATUS_IGNORE);
+                        std::vector<SegmentEntry> entries(table_len / container.entry_size());
+                        container.parse_entries(table.data(), entries.size(), entries.data());
+                        store_entries(range, entries.data(), entries.size());
+                    }
+                    trace.add(JobTrace::Gather, begin, JobTrace::MAIN_TRACK, len);
+
+                    if (ships_data) {
+                        output_len += len;
+                        if (!output_map) {
+                            write_output(layout_len + range.begin, destination, len);
+                        }
+                    }
+                    // the stop only goes out once the worker has nothing queued
+                    if (next_unit < num_units || queued[rank].empty()) {
+                        send_unit(rank);
+                    }
+                };
+
+                for (int i = 1; i < world_size; i++) {
+                    for (long long k = 0; k < seed[i] && next_unit < num_units; k++) {
+                        send_unit(i);
+                    }
+                    if (queued[i].empty()) {
+                        send_unit(i);
                     }
                 }
 
-                if (remaining_bytes > 0) {
-                    int final_len = cipher.encrypt_aes_ecb(
-                        reinterpret_cast<const unsigned char*>(my_chunk.data() + num_blocks * AES_BLOCK_SIZE), remaining_bytes, encrypted_chunk.data() + num_blocks * AES_BLOCK_SIZE);
-                    if (final_len < 0) {
-                        throw std::runtime_error("Encryption failed in AES-ECB mode.");
+                PoolBuffer own_input;
+                PoolBuffer own_output;
+                while (true) {
+                    while (outstanding > 0) {
+                        int waiting = 1;
+                        MPI_Status status;
+                        if (next_unit < num_units) {
+                            MPI_Iprobe(MPI_ANY_SOURCE, 9, comm, &waiting, &status);
+                        } else {
+                            MPI_Probe(MPI_ANY_SOURCE, 9, comm, &status);
+                        }
+                        if (!waiting) {
+                            break;
+                        }
+                        collect(status.MPI_SOURCE);
+                    }
+                    reap();
+                    if (next_unit >= num_units) {
+                        break;
+                    }
+
+                    Range range = unit_range(next_unit++);
+                    size_t prefix = unit_prefix(range);
+                    size_t offset = stream_begin + range.begin - prefix;
+                    const unsigned char* input;
+                    if (input_map) {
+                        input = input_map->data() + offset;
+                    } else {
+                        // a spare block for ECB padding written in place
+                        own_input.resize(prefix + range.size() + AES_BLOCK_SIZE);
+                        double begin = trace.now();
+                        read_input(offset, own_input.data(), prefix + range.size());
+                        trace.add(JobTrace::Read, begin, JobTrace::MAIN_TRACK, prefix + range.size());
+                        input = own_input.data();
+                    }
+                    unsigned char* output;
+                    if (output_map) {
+                        output = output_map->data() + layout_len + range.begin;
+                    } else if (in_place) {
+                        output = own_input.data() + prefix;
+                    } else {
+                        own_output.resize(range.size() + AES_BLOCK_SIZE);
+                        output = own_output.data();
+                    }
+
+                    std::vector<SegmentEntry> entries;
+                    long long len = transform_unit(range, input, output, entries);
+                    store_entries(range, entries.data(), entries.size());
+                    output_len += len;
+                    if (!output_map) {
+                        write_output(layout_len + range.begin, output, len);
                     }
-                } else {
-                    encrypted_len += num_blocks * AES_BLOCK_SIZE;
                 }
 
-                if (encrypted_len < 0) {
-                    throw std::runtime_error("Encryption failed in AES-ECB mode.");
+                for (Dispatch& dispatch : dispatches) {
+                    MPI_Waitall(2, dispatch.requests, MPI_STATUSES_IGNORE);
                 }
+                dispatches.clear();
+                // the trailer follows the data
+                if (output_file.is_open()) {
+                    output_file.seekp(layout_len + output_len);
+                }
+            } else {
+                // Two units in flight: the next one arrives while this one is
+                // transformed, and a slot is posted again as soon as its input
+                // has been used.
+                PoolBuffer unit_input[2];
+                PoolBuffer unit_output[2];
+                long long index[2];
+                MPI_Request index_request[2];
+                MPI_Request data_request[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+                MPI_Request result_request[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+                // the last unit also carries the tail of the stream
+                size_t capacity = unit_size + alignment + AES_BLOCK_SIZE;
 
-                if (world_rank == 0) {
-                    std::vector<unsigned char> all_encrypted_data;
-                    all_encrypted_data.insert(all_encrypted_data.end(), encrypted_chunk.begin(), encrypted_chunk.begin() + encrypted_len);
+                auto post = [&](int slot) {
+                    MPI_Irecv(&index[slot], 1, MPI_LONG_LONG, 0, 8, comm, &index_request[slot]);
+                    if (ships_data) {
+                        unit_input[slot].resize(capacity);
+                        MPI_Irecv(unit_input[slot].data(), capacity, MPI_UNSIGNED_CHAR, 0, 11, comm, &data_request[slot]);
+                    }
+                };
 
-                    for (int i = 1; i < world_size; i++) {
-                        int recv_encrypted_len;
-                        MPI_Recv(&recv_encrypted_len, 1, MPI_INT, i, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                post(0);
+                post(1);
+                for (int slot = 0;; slot = 1 - slot) {
+                    phase_begin = trace.now();
+                    MPI_Wait(&index_request[slot], MPI_STATUS_IGNORE);
+                    MPI_Wait(&data_request[slot], MPI_STATUS_IGNORE);
+                    trace.add(JobTrace::Scatter, phase_begin);
+                    if (index[slot] < 0) {
+                        // the stop is the last message; nothing comes for the other slot
+                        MPI_Cancel(&index_request[1 - slot]);
+                        MPI_Wait(&index_request[1 - slot], MPI_STATUS_IGNORE);
+                        if (ships_data) {
+                            MPI_Cancel(&data_request[1 - slot]);
+                            MPI_Wait(&data_request[1 - slot], MPI_STATUS_IGNORE);
+                        }
+                        break;
+                    }
 
-                        std::vector<unsigned char> recv_encrypted(recv_encrypted_len);
-                        MPI_Recv(recv_encrypted.data(), recv_encrypted_len, MPI_UNSIGNED_CHAR, i, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                        
-                        std::cout << "Rank 0 received encrypted data from rank " << i 
-                                << " of size " << recv_encrypted_len << " bytes." << std::endl;
-                        all_encrypted_data.insert(all_encrypted_data.end(), recv_encrypted.begin(), recv_encrypted.end());
+                    Range range = unit_range(index[slot]);
+                    size_t prefix = unit_prefix(range);
+                    size_t offset = stream_begin + range.begin - prefix;
+                    const unsigned char* input;
+                    if (ships_data) {
+                        input = unit_input[slot].data();
+                    } else if (input_map) {
+                        input = input_map->data() + offset;
+                    } else {
+                        unit_input[slot].resize(capacity);
+                        phase_begin = trace.now();
+                        read_input(offset, unit_input[slot].data(), prefix + range.size());
+                        trace.add(JobTrace::Read, phase_begin, JobTrace::MAIN_TRACK, prefix + range.size());
+                        input = unit_input[slot].data();
+                    }
+                    unsigned char* output;
+                    if (output_map) {
+                        output = output_map->data() + layout_len + range.begin;
+                    } else {
+                        // the result of two units ago must have left
+                        phase_begin = trace.now();
+                        MPI_Wait(&result_request[slot], MPI_STATUS_IGNORE);
+                        trace.add(JobTrace::Gather, phase_begin);
+                        unit_output[slot].resize(range.size() + AES_BLOCK_SIZE);
+                        output = unit_output[slot].data();
+                    }
+
+                    std::vector<SegmentEntry> entries;
+                    long long len = transform_unit(range, input, output, entries);
+                    post(slot);
+                    if (!ships_data) {
+                        if (!output_map) {
+                            write_output(layout_len + range.begin, output, len);
+                        }
+                        output_len += len;
                     }
 
-                    std::string output_file_name = filename_without_extenstion + "_output.bin";
-                    std::ofstream output_file(output_file_name, std::ios::binary);
-                    output_file.write(reinterpret_cast<const char*>(all_encrypted_data.data()), all_encrypted_data.size());
-                    output_file.close();
+                    phase_begin = trace.now();
+                    MPI_Isend(output, ships_data ? len : 0, MPI_UNSIGNED_CHAR, 0, 9, comm, &result_request[slot]);
+                    if (segmented && operation == "encrypt") {
+                        std::vector<unsigned char> table(entries.size() * container.entry_size());
+                        container.serialize_entries(entries.data(), entries.size(), table.data());
+                        MPI_Send(table.data(), table.size(), MPI_UNSIGNED_CHAR, 0, 10, comm);
+                    }
+                    trace.add(JobTrace::Gather, phase_begin);
+                }
+                MPI_Waitall(2, result_request, MPI_STATUSES_IGNORE);
+            }
 
-                    std::cout << "Rank 0: Wrote encrypted data to " << output_file_name 
-                            << " of size " << all_encrypted_data.size() << " bytes." << std::endl;
+            // Per-rank load: units, bytes and the time spent transforming them,
+            // against the time the whole deal took on rank 0.
+            units_elapsed = MPI_Wtime() - units_begin;
+            double mine[3] = {my_units, my_bytes, busy};
+            std::vector<double> loads(world_rank == 0 ? 3 * world_size : 0);
+            MPI_Gather(mine, 3, MPI_DOUBLE, loads.data(), 3, MPI_DOUBLE, 0, comm);
+            if (world_rank != 0) {
+                return;
+            }
+
+            std::map<std::string, std::pair<double, double>> host_load;
+            for (int i = 0; i < world_size; i++) {
+                double units = loads[3 * i], bytes = loads[3 * i + 1], seconds = loads[3 * i + 2];
+                std::cout << "Rank 0: Rank " << i << " (" << host_of(i) << ") did " << units << " units, "
+                          << static_cast<long long>(bytes) << " bytes, busy " << seconds << " s of "
+                          << units_elapsed << " s (" << std::llround(100 * seconds / std::max(units_elapsed, 1e-9))
+                          << "%) at " << (seconds > 0 ? bytes / seconds / 1e6 : 0) << " MB/s." << std::endl;
+                if (seconds > 0) {
+                    host_load[host_of(i)].first += bytes;
+                    host_load[host_of(i)].second += seconds;
+                }
+            }
+            if (!options.weights_file.empty()) {
+                // the new rate is averaged with the old one, so one disturbed
+                // job does not swing the next
+                std::map<std::string, double> weights = read_weights(options.weights_file);
+                for (const auto& entry : host_load) {
+                    double rate = entry.second.first / entry.second.second / 1e6;
+                    double& weight = weights[entry.first];
+                    weight = weight > 0 ? (weight + rate) / 2 : rate;
+                }
+                if (!write_weights(options.weights_file, weights)) {
+                    std::cerr << "Rank 0: Could not write the weights to " << options.weights_file << "." << std::endl;
+                }
+            }
+        };
+
+        auto start_read = [&](size_t w) {
+            int slot = w % 2;
+            if (in_place) {
+                // the slot holds the output of window w-2 until it has left
+                MPI_Wait(&write_request[slot], MPI_STATUS_IGNORE);
+                MPI_Wait(&gather_request[slot], MPI_STATUS_IGNORE);
+            }
+            if (input_map) {
+                // the mapping is the buffer: only ask the kernel to read ahead
+                Range range = use_mpi_io ? piece_range(w, world_rank) : window_range(w);
+                input_map->prefetch(stream_begin + range.begin, range.size());
+            } else if (use_mpi_io) {
+                Range piece = piece_range(w, world_rank);
+                // a spare block for ECB padding written in place
+                my_input[slot].resize(piece.size() + AES_BLOCK_SIZE);
+                if (packed_input) {
+                    // produced by deflating, not read, so there is nothing to overlap
+                    read_input(stream_begin + piece.begin, my_input[slot].data(), piece.size());
                 } else {
-                    MPI_Send(&encrypted_len, 1, MPI_INT, 0, 2, MPI_COMM_WORLD);
-                    MPI_Send(encrypted_chunk.data(), encrypted_len, MPI_UNSIGNED_CHAR, 0, 1, MPI_COMM_WORLD);
+                    MPI_File_iread_at(input_fh, stream_begin + piece.begin, my_input[slot].data(), piece.size(),
+                                      MPI_CHAR, &read_request[slot]);
                 }
+            } else if (world_rank == 0) {
+                Range window = window_range(w);
+                // rank 0's own piece leads the window
+                window_buffer[slot].resize(window.size() + AES_BLOCK_SIZE, piece_range(w, 0).size());
+                pending_read = std::async(std::launch::async, [&, window, slot]() {
+                    double begin = trace.now();
+                    read_input(stream_begin + window.begin, window_buffer[slot].data(), window.size());
+                    trace.add(JobTrace::Read, begin, JobTrace::IO_TRACK, window.size());
+                });
             }
-        } else if (operation == "decrypt") {
-            if (mode == "aes-128-cbc") {
-                std::cout << "Process " << world_rank << " starting decryption." << std::endl;
-    
-                std::vector<unsigned char> decrypted_chunk(my_chunk_size + AES_BLOCK_SIZE);
-                int decrypted_len = cipher.decrypt_aes_cbc(reinterpret_cast<const unsigned char*>(my_chunk.data()),
-                                                            my_chunk_size, decrypted_chunk.data()
-                                                        );
-                if (decrypted_len < 0) {
-                    throw std::runtime_error("Decryption failed in AES-CBC mode.");
-                }
-    
-                if (world_rank == 0) {
-                    std::vector<unsigned char> all_decrypted_data;
-                    all_decrypted_data.insert(all_decrypted_data.end(), decrypted_chunk.begin(), decrypted_chunk.begin() + decrypted_len);
-    
-                    for (int i = 1; i < world_size; i++) {
-                        int recv_decrypted_len;
-                        MPI_Recv(&recv_decrypted_len, 1, MPI_INT, i, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    
-                        std::vector<unsigned char> recv_decrypted(recv_decrypted_len);
-                        MPI_Recv(recv_decrypted.data(), recv_decrypted_len, MPI_UNSIGNED_CHAR, i, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                        
-                        std::cout << "Rank 0 received decrypted data from rank " << i 
-                                << " of size " << recv_decrypted_len << " bytes." << std::endl;
-                        all_decrypted_data.insert(all_decrypted_data.end(), recv_decrypted.begin(), recv_decrypted.end());
-                    }
-    
-                    std::string output_file_name = filename_without_extenstion + "_outputdecrypted.bmp";
-                    std::ofstream output_file(output_file_name, std::ios::binary);
-                    output_file.write(reinterpret_cast<const char*>(all_decrypted_data.data()), all_decrypted_data.size());
-                    output_file.close();
-    
-                    std::cout << "Rank 0: Wrote decrypted data to " << output_file_name 
-                            << " of size " << all_decrypted_data.size() << " bytes." << std::endl;
+        };
+
+        if (dynamic) {
+            run_units();
+        } else {
+            start_read(0);
+            for (size_t w = 0; w < num_windows; w++) {
+                int slot = w % 2;
+                Range window = window_range(w);
+                Range piece = piece_range(w, world_rank);
+                bool stream_end = is_last_rank && w + 1 == num_windows;
+
+                const unsigned char* input;
+                MPI_Request scatter_request = MPI_REQUEST_NULL;
+                if (use_mpi_io && input_map) {
+                    if (w + 1 < num_windows) {
+                        start_read(w + 1);
+                    }
+                    input = input_map->data() + stream_begin + piece.begin;
+                } else if (use_mpi_io) {
+                    phase_begin = trace.now();
+                    MPI_Wait(&read_request[slot], MPI_STATUS_IGNORE);
+                    trace.add(JobTrace::Read, phase_begin, JobTrace::MAIN_TRACK, piece.size());
+                    if (w + 1 < num_windows) {
+                        start_read(w + 1);
+                    }
+                    input = my_input[slot].data();
                 } else {
-                    MPI_Send(&decrypted_len, 1, MPI_INT, 0, 2, MPI_COMM_WORLD);
-                    MPI_Send(decrypted_chunk.data(), decrypted_len, MPI_UNSIGNED_CHAR, 0, 1, MPI_COMM_WORLD);
+                    // Rank 0 scatters with a non-blocking collective and starts on its
+                    // own piece straight out of the window while the rest is in flight.
+                    std::vector<int> send_counts, send_displs;
+                    char* window_data = input_map
+                        ? reinterpret_cast<char*>(input_map->data() + stream_begin + window.begin)
+                        : reinterpret_cast<char*>(window_buffer[slot].data());
+                    if (world_rank == 0) {
+                        // time spent waiting for the reader is on the critical path
+                        if (pending_read.valid()) {
+                            phase_begin = trace.now();
+                            pending_read.get();
+                            trace.add(JobTrace::Read, phase_begin);
+                        }
+                        for (int i = 0; i < world_size; i++) {
+                            Range range = piece_range(w, i);
+                            send_counts.push_back(range.size());
+                            send_displs.push_back(range.begin - window.begin);
+                        }
+                    }
+
+                    my_input[slot].resize(world_rank == 0 ? 0 : piece.size() + AES_BLOCK_SIZE);
+                    phase_begin = trace.now();
+                    MPI_Iscatterv(window_data, send_counts.data(), send_displs.data(), MPI_CHAR,
+                                  world_rank == 0 ? MPI_IN_PLACE : my_input[slot].data(), piece.size(), MPI_CHAR,
+                                  0, comm, &scatter_request);
+                    if (world_rank != 0) {
+                        MPI_Wait(&scatter_request, MPI_STATUS_IGNORE);
+                    }
+                    trace.add(JobTrace::Scatter, phase_begin, JobTrace::MAIN_TRACK, piece.size());
+                    if (world_rank == 0 && w + 1 < num_windows) {
+                        start_read(w + 1);
+                    }
+                    input = world_rank == 0 ? reinterpret_cast<const unsigned char*>(window_data) + (piece.begin - window.begin)
+                                            : my_input[slot].data();
                 }
-            } else {
-                std::cout << "Process " << world_rank << " starting decryption." << std::endl;
-
-                std::vector<unsigned char> decrypted_chunk(my_chunk_size + AES_BLOCK_SIZE);
-                
-                int num_blocks = my_chunk_size / AES_BLOCK_SIZE;
-                int remaining_bytes = my_chunk_size % AES_BLOCK_SIZE;
-                
-                int decrypted_len = 0;
-                
-                #pragma omp parallel for reduction(+:decrypted_len)
-                for (int block = 0; block < num_blocks; block++) {
-                    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-                    if (ctx) {
-                        int len;
-                        if (EVP_DecryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, 
-                                             reinterpret_cast<const unsigned char*>(key.c_str()), NULL) == 1) {
-                            EVP_CIPHER_CTX_set_padding(ctx, 0);
-                            
-                            const unsigned char* input = reinterpret_cast<const unsigned char*>(my_chunk.data()) 
-                                                        + block * AES_BLOCK_SIZE;
-                            unsigned char* output = decrypted_chunk.data() + block * AES_BLOCK_SIZE;
-                            
-                            if (EVP_DecryptUpdate(ctx, output, &len, input, AES_BLOCK_SIZE) == 1) {
-                                #pragma omp atomic
-                                decrypted_len += len;
-                            }
+
+                if (num_windows == 1) {
+                    std::cout << "Process " << world_rank << " recieved chunk of size " 
+                              << piece.size() << " bytes." << std::endl;
+                }
+
+                // CBC needs the ciphertext block in front of the piece: from the left
+                // neighbour inside a window, from the previous window at its start
+                unsigned char previous_block[AES_BLOCK_SIZE];
+                unsigned char last_ciphertext[AES_BLOCK_SIZE];
+                std::copy(cipher.get_iv(), cipher.get_iv() + AES_BLOCK_SIZE, previous_block);
+                int right = MPI_PROC_NULL;
+                if (mode == "aes-128-cbc" && piece.size() > 0) {
+                    phase_begin = trace.now();
+                    int left = nearest_rank_with_data(window.size(), world_size, world_rank, -1, alignment);
+                    right = nearest_rank_with_data(window.size(), world_size, world_rank, 1, alignment);
+
+                    if (operation == "decrypt") {
+                        // Halo exchange: every rank hands its last ciphertext block to
+                        // the right and receives the block in front of its own piece,
+                        // which is all CBC decryption needs to run fully in parallel.
+                        // (kept aside too, as decrypting in place overwrites it)
+                        std::copy(input + piece.size() - AES_BLOCK_SIZE, input + piece.size(), last_ciphertext);
+                        MPI_Sendrecv(last_ciphertext, AES_BLOCK_SIZE, MPI_UNSIGNED_CHAR, right, 3,
+                                     previous_block, AES_BLOCK_SIZE, MPI_UNSIGNED_CHAR, left, 3,
+                                     comm, MPI_STATUS_IGNORE);
+                    } else if (left != MPI_PROC_NULL) {
+                        // encryption is a chain: wait for the left neighbour's last block
+                        MPI_Recv(previous_block, AES_BLOCK_SIZE, MPI_UNSIGNED_CHAR, left, 3, comm, MPI_STATUS_IGNORE);
+                    }
+
+                    if (left == MPI_PROC_NULL && w > 0) {
+                        if (is_last_rank) {
+                            std::copy(carry_block, carry_block + AES_BLOCK_SIZE, previous_block);
+                        } else {
+                            MPI_Recv(previous_block, AES_BLOCK_SIZE, MPI_UNSIGNED_CHAR, world_size - 1, 4, comm,
+                                     MPI_STATUS_IGNORE);
                         }
-                        EVP_CIPHER_CTX_free(ctx);
                     }
+                    trace.add(JobTrace::Chain, phase_begin);
                 }
-                
-                if (remaining_bytes > 0) {
-                    int final_len = cipher.decrypt_aes_ecb(
-                        reinterpret_cast<const unsigned char*>(my_chunk.data()) + num_blocks * AES_BLOCK_SIZE,
-                        remaining_bytes, 
-                        decrypted_chunk.data() + num_blocks * AES_BLOCK_SIZE
-                    );
-                    if (final_len > 0) {
-                        decrypted_len += final_len;
+
+                // the buffer of window w-2 must have left before it is reused; a
+                // mapped output is written in place at the piece's final offset
+                unsigned char* output;
+                if (!use_mpi_io && world_rank == 0) {
+                    // window w-1 goes to the writer, which then has written w-2 and
+                    // freed its buffer for this window; rank 0's piece leads it
+                    if (w > 0) {
+                        finish_window(1 - slot);
+                    }
+                    if (output_map) {
+                        output = output_map->data() + layout_len + window.begin;
+                    } else {
+                        gathered[slot].resize(window.size() + AES_BLOCK_SIZE, 0);
+                        output = gathered[slot].data();
                     }
+                    post_receives(w, output);
+                } else if (output_map) {
+                    output = output_map->data() + layout_len + piece.begin;
+                } else if (in_place) {
+                    // the piece sits in a buffer of this job, not in a mapping
+                    output = const_cast<unsigned char*>(input);
                 } else {
-                    decrypted_len = num_blocks * AES_BLOCK_SIZE;
+                    phase_begin = trace.now();
+                    MPI_Wait(&write_request[slot], MPI_STATUS_IGNORE);
+                    trace.add(JobTrace::Write, phase_begin);
+                    my_output[slot].resize(piece.size() + AES_BLOCK_SIZE);
+                    output = my_output[slot].data();
                 }
+                std::vector<SegmentEntry> new_entries;
 
-                if (decrypted_len <= 0) {
-                    throw std::runtime_error("Decryption failed in AES-ECB mode.");
+                phase_begin = trace.now();
+                long long processed_len = transform_piece(input, piece.size(), piece.begin, stream_end,
+                                                          previous_block, output, new_entries);
+                trace.add(JobTrace::Compute, phase_begin, JobTrace::MAIN_TRACK, piece.size());
+
+                if (mode == "aes-128-cbc" && piece.size() > 0) {
+                    phase_begin = trace.now();
+                    const unsigned char* last_block = operation == "encrypt"
+                        ? output + processed_len - AES_BLOCK_SIZE
+                        : last_ciphertext;
+                    if (operation == "encrypt" && right != MPI_PROC_NULL) {
+                        MPI_Send(last_block, AES_BLOCK_SIZE, MPI_UNSIGNED_CHAR, right, 3, comm);
+                    }
+                    if (is_last_rank && w + 1 < num_windows) {
+                        int next_first = nearest_rank_with_data(window_range(w + 1).size(), world_size, -1, 1, alignment);
+                        MPI_Wait(&carry_request, MPI_STATUS_IGNORE);
+                        std::copy(last_block, last_block + AES_BLOCK_SIZE, carry_block);
+                        if (next_first != world_rank) {
+                            MPI_Isend(carry_block, AES_BLOCK_SIZE, MPI_UNSIGNED_CHAR, next_first, 4, comm, &carry_request);
+                        }
+                    }
+                    trace.add(JobTrace::Chain, phase_begin);
                 }
-    
-                if (world_rank == 0) {
-                    std::vector<unsigned char> all_decrypted_data;
-                    all_decrypted_data.insert(all_decrypted_data.end(), decrypted_chunk.begin(), decrypted_chunk.begin() + decrypted_len);
-    
-                    for (int i = 1; i < world_size; i++) {
-                        int recv_decrypted_len;
-                        MPI_Recv(&recv_decrypted_len, 1, MPI_INT, i, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    
-                        std::vector<unsigned char> recv_decrypted(recv_decrypted_len);
-                        MPI_Recv(recv_decrypted.data(), recv_decrypted_len, MPI_UNSIGNED_CHAR, i, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                        
-                        std::cout << "Rank 0 received decrypted data from rank " << i 
-                                << " of size " << recv_decrypted_len << " bytes." << std::endl;
-                        all_decrypted_data.insert(all_decrypted_data.end(), recv_decrypted.begin(), recv_decrypted.end());
-                    }
-    
-                    std::string output_file_name = filename_without_extenstion + "_outputdecrypted.bmp";
-                    std::ofstream output_file(output_file_name, std::ios::binary);
-                    output_file.write(reinterpret_cast<const char*>(all_decrypted_data.data()), all_decrypted_data.size());
-                    output_file.close();
-    
-                    std::cout << "Rank 0: Wrote decrypted data to " << output_file_name 
-                            << " of size " << all_decrypted_data.size() << " bytes." << std::endl;
+
+                // rank 0's own work is done; let the scatter finish before collecting
+                phase_begin = trace.now();
+                MPI_Wait(&scatter_request, MPI_STATUS_IGNORE);
+                trace.add(JobTrace::Scatter, phase_begin);
+
+                phase_begin = trace.now();
+                if (segmented && operation == "encrypt") {
+                    std::vector<unsigned char> my_table(new_entries.size() * container.entry_size());
+                    container.serialize_entries(new_entries.data(), new_entries.size(), my_table.data());
+                    std::vector<unsigned char> table = gather_to_root(my_table.data(), my_table.size(), world_rank,
+                                                                      world_size, comm);
+                    size_t first = container.segments.size();
+                    container.segments.resize(first + table.size() / container.entry_size());
+                    container.parse_entries(table.data(), container.segments.size() - first, container.segments.data() + first);
+                }
+
+                if (use_mpi_io && output_map) {
+                    trace.add(JobTrace::Gather, phase_begin);
+                    output_len += processed_len;
+                } else if (use_mpi_io) {
+                    // Each rank writes its own output range; the offsets are an
+                    // exclusive prefix sum of the per-rank lengths in this window.
+                    long long my_offset = 0;
+                    MPI_Exscan(&processed_len, &my_offset, 1, MPI_LONG_LONG, MPI_SUM, comm);
+                    if (world_rank == 0) {
+                        my_offset = 0;
+                    }
+                    trace.add(JobTrace::Gather, phase_begin);
+                    phase_begin = trace.now();
+                    MPI_File_iwrite_at(output_fh, layout_len + window.begin + my_offset, output, processed_len,
+                                       MPI_UNSIGNED_CHAR, &write_request[slot]);
+                    trace.add(JobTrace::Write, phase_begin, JobTrace::MAIN_TRACK, processed_len);
+                    output_len += processed_len;
+                } else if (world_rank == 0) {
+                    // the others' pieces land next to it; see finish_window
+                    window_len[slot] = processed_len;
+                    trace.add(JobTrace::Gather, phase_begin);
                 } else {
-                    MPI_Send(&decrypted_len, 1, MPI_INT, 0, 2, MPI_COMM_WORLD);
-                    MPI_Send(decrypted_chunk.data(), decrypted_len, MPI_UNSIGNED_CHAR, 0, 1, MPI_COMM_WORLD);
+                    if (piece.size() > 0 || stream_end) {
+                        MPI_Isend(output, processed_len, MPI_UNSIGNED_CHAR, 0, 7, comm, &gather_request[slot]);
+                    }
+                    // window w-1 has been received; its buffer is free again
+                    if (w > 0) {
+                        MPI_Wait(&gather_request[1 - slot], MPI_STATUS_IGNORE);
+                    }
+                    trace.add(JobTrace::Gather, phase_begin);
                 }
             }
+        }
+
+        // what goes in front of the data: the container header and table, or
+        // the CTR counter block
+        auto serialize_layout = [&]() {
+            return ctr ? std::vector<unsigned char>(counter_iv, counter_iv + CTR_HEADER_SIZE) : container.serialize();
+        };
+
+        // the spans recorded in here are taken out of finalize's own time
+        double finalize_begin = trace.now();
+        MPI_Wait(&carry_request, MPI_STATUS_IGNORE);
+
+        if (output_map) {
+            if (use_mpi_io) {
+                MPI_Allreduce(MPI_IN_PLACE, &output_len, 1, MPI_LONG_LONG, MPI_SUM, comm);
+            } else if (!dynamic) {
+                finish_window((num_windows - 1) % 2);
+            }
+            if (world_rank == 0 && layout_len > 0) {
+                std::vector<unsigned char> layout = serialize_layout();
+                std::vector<unsigned char> trailer = container.serialize_trailer();
+                std::copy(layout.begin(), layout.end(), output_map->data());
+                std::copy(trailer.begin(), trailer.end(), output_map->data() + layout_len + output_len);
+            }
+            // every rank's pages must be out before the file is cut to length
+            phase_begin = trace.now();
+            try {
+                output_map->sync();
+            } catch (const std::exception& e) {
+                note_error(e.what());
+            }
+            trace.add(JobTrace::Write, phase_begin);
+            if (use_mpi_io) {
+                MPI_Barrier(comm);
+            }
+            if (world_rank == 0) {
+                phase_begin = trace.now();
+                try {
+                    output_map->truncate(layout_len + output_len + trailer_len);
+                } catch (const std::exception& e) {
+                    note_error(e.what());
+                }
+                trace.add(JobTrace::Write, phase_begin);
+            }
+        } else if (use_mmap) {
+            // ranks without the mapping only took part in the collectives
+            MPI_Waitall(2, gather_request, MPI_STATUSES_IGNORE);
+        } else if (use_mpi_io) {
+            phase_begin = trace.now();
+            MPI_Waitall(2, write_request, MPI_STATUSES_IGNORE);
+            trace.add(JobTrace::Write, phase_begin);
+            MPI_Allreduce(MPI_IN_PLACE, &output_len, 1, MPI_LONG_LONG, MPI_SUM, comm);
+            phase_begin = trace.now();
+            if (world_rank == 0 && layout_len > 0) {
+                std::vector<unsigned char> layout = serialize_layout();
+                std::vector<unsigned char> trailer = container.serialize_trailer();
+                MPI_File_write_at(output_fh, 0, layout.data(), layout.size(), MPI_UNSIGNED_CHAR, MPI_STATUS_IGNORE);
+                MPI_File_write_at(output_fh, layout_len + output_len, trailer.data(), trailer.size(), MPI_UNSIGNED_CHAR,
+                                  MPI_STATUS_IGNORE);
+            }
+            MPI_File_close(&output_fh);
+            if (input_fh != MPI_FILE_NULL) {
+                MPI_File_close(&input_fh);
+            }
+            trace.add(JobTrace::Write, phase_begin);
         } else {
-            throw std::invalid_argument("Invalid operation. Use 'encrypt' or 'decrypt'.");
+            if (world_rank == 0) {
+                if (!dynamic) {
+                    finish_window((num_windows - 1) % 2);
+                }
+                phase_begin = trace.now();
+                if (pending_write.valid()) {
+                    pending_write.get();
+                }
+                if (layout_len > 0) {
+                    std::vector<unsigned char> trailer = container.serialize_trailer();
+                    output_file.write(reinterpret_cast<const char*>(trailer.data()), trailer.size());
+                    std::vector<unsigned char> layout = serialize_layout();
+                    output_file.seekp(0);
+                    output_file.write(reinterpret_cast<const char*>(layout.data()), layout.size());
+                }
+                output_file.close();
+                trace.add(JobTrace::Write, phase_begin);
+            } else {
+                phase_begin = trace.now();
+                MPI_Waitall(2, gather_request, MPI_STATUSES_IGNORE);
+                trace.add(JobTrace::Gather, phase_begin);
+            }
+        }
+        trace.add(JobTrace::Finalize, finalize_begin);
+        if (!agree_on_error(error, comm)) {
+            return fail_job();
+        }
+        if (world_rank == 0 && std::rename(partial_file_name.c_str(), output_file_name.c_str()) != 0) {
+            note_error("Error writing output file.");
+        }
+        if (!agree_on_error(error, comm)) {
+            return fail_job();
+        }
+
+        if (world_rank == 0) {
+            std::cout << "Rank 0: Wrote " << operation << "ed data to " << output_file_name 
+                    << " of size " << layout_len + output_len + trailer_len << " bytes";
+            if (dynamic) {
+                std::cout << " in " << num_units << " units of " << unit_size << " bytes";
+            } else if (num_windows > 1) {
+                std::cout << " in " << num_windows << " windows of " << window_size << " bytes";
+            }
+            std::cout << " in " << MPI_Wtime() - start_time << " s." << std::endl;
         }
+        trace.report(options.trace_file.empty() ? filename_without_extenstion + "_trace.json" : options.trace_file);
     } catch (const std::exception& e) {
+        // anything else, e.g. running out of memory, may leave the other ranks
+        // waiting in a collective
         std::cerr << "Error: " << e.what() << std::endl;
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
 
+    return JobResult{output_file_name, ""};
+}
+
+// Prepares the block stream of the file of `job` for transform_job(). Each
+// rank deflates its own run of whole blocks a window at a time (the --stream
+// size, at most MAX_WINDOW_SIZE): with --mpi-io it reads the run itself,
+// otherwise rank 0 reads each window of every run and sends it over. The
+// ranks that transform_job() reads its input on get the stream with the
+// table of all blocks, the others get null. Without --stream the blocks come
+// along, so nothing is deflated twice; with it the stream deflates a window's
+// blocks again when that window is read, so no rank holds more than a window.
+// On failure every rank gets the same `error`.
+std::unique_ptr<ZBlockStream> compress_input(const Job& job, const JobOptions& options, MPI_Comm comm,
+                                             std::string& error) {
+    int world_size;
+    MPI_Comm_size(comm, &world_size);
+
+    int world_rank;
+    MPI_Comm_rank(comm, &world_rank);
+
+    double start_time = MPI_Wtime();
+    bool reads_input = options.use_mpi_io || world_rank == 0;
+    std::unique_ptr<ZBlockStream> stream;
+    size_t total_size = 0;
+    if (reads_input) {
+        try {
+            stream.reset(new ZBlockStream(job.filename, options.compress_level));
+            total_size = stream->input_size();
+        } catch (const std::exception& e) {
+            error = e.what();
+        }
+    }
+    if (!agree_on_error(error, comm)) {
+        return nullptr;
+    }
+    MPI_Bcast(&total_size, 1, MPI_UNSIGNED_LONG, 0, comm);
+
+    try {
+        // whole blocks, and never more than an MPI count holds
+        size_t window = std::min(options.stream_window > 0 ? options.stream_window : MAX_WINDOW_SIZE, MAX_WINDOW_SIZE);
+        window = std::max(ZBLOCK_SIZE, window / ZBLOCK_SIZE * ZBLOCK_SIZE);
+        bool keep_blocks = options.stream_window == 0;
+
+        auto run_of = [&](int rank) {
+            return partition_range(total_size, world_size, rank, ZBLOCK_SIZE);
+        };
+        auto window_of = [&](const Range& run, size_t w) {
+            return Range{std::min(run.end, run.begin + w * window), std::min(run.end, run.begin + (w + 1) * window)};
+        };
+        size_t num_windows = 0;
+        for (int rank = 0; rank < world_size; rank++) {
+            num_windows = std::max(num_windows, (run_of(rank).size() + window - 1) / window);
+        }
+
+        std::vector<unsigned char> plain;
+        auto read_window = [&](const Range& range) {
+            plain.resize(range.size());
+            if (!stream->read_input(range.begin, plain.data(), range.size()) && error.empty()) {
+                error = "Error reading input file.";
+            }
+        };
+
+        Range run = run_of(world_rank);
+        std::vector<unsigned char> packed;
+        std::vector<uint32_t> lengths;
+        for (size_t w = 0; w < num_windows; w++) {
+            if (world_rank == 0 && !options.use_mpi_io) {
+                for (int rank = 1; rank < world_size; rank++) {
+                    Range range = window_of(run_of(rank), w);
+                    if (range.size() > 0) {
+                        read_window(range);
+                        MPI_Send(plain.data(), range.size(), MPI_UNSIGNED_CHAR, rank, 12, comm);
+                    }
+                }
+            }
+            Range range = window_of(run, w);
+            if (range.size() == 0) {
+                continue;
+            }
+            if (reads_input) {
+                read_window(range);
+            } else {
+                plain.resize(range.size());
+                MPI_Recv(plain.data(), range.size(), MPI_UNSIGNED_CHAR, 0, 12, comm, MPI_STATUS_IGNORE);
+            }
+            if (!keep_blocks) {
+                packed.clear();
+            }
+            compress_blocks(plain.data(), range.size(), options.compress_level, packed, lengths);
+        }
+        std::vector<unsigned char>().swap(plain);
+        if (!agree_on_error(error, comm)) {
+            return nullptr;
+        }
+
+        // every rank's table entries, in rank order
+        std::vector<int> counts(world_size), displs(world_size);
+        for (int rank = 0; rank < world_size; rank++) {
+            Range other = run_of(rank);
+            counts[rank] = zblock_count(other.size());
+            displs[rank] = other.begin / ZBLOCK_SIZE;
+        }
+        std::vector<uint32_t> table(reads_input ? zblock_count(total_size) : 0);
+        if (options.use_mpi_io) {
+            MPI_Allgatherv(lengths.data(), lengths.size(), MPI_UINT32_T, table.data(), counts.data(), displs.data(),
+                           MPI_UINT32_T, comm);
+        } else {
+            MPI_Gatherv(lengths.data(), lengths.size(), MPI_UINT32_T, table.data(), counts.data(), displs.data(),
+                        MPI_UINT32_T, 0, comm);
+        }
+        if (stream) {
+            stream->set_lengths(std::move(table));
+        }
+
+        if (keep_blocks) {
+            // every rank's blocks, in rank order, in pieces an MPI count holds
+            unsigned long packed_size = packed.size();
+            std::vector<unsigned long> packed_sizes(world_size);
+            MPI_Allgather(&packed_size, 1, MPI_UNSIGNED_LONG, packed_sizes.data(), 1, MPI_UNSIGNED_LONG, comm);
+            size_t blocks_size = 0;
+            for (unsigned long size : packed_sizes) {
+                blocks_size += size;
+            }
+            std::vector<unsigned char> blocks(stream ? blocks_size : 0);
+            size_t offset = 0;
+            for (int rank = 0; rank < world_size; rank++) {
+                for (size_t done = 0; done < packed_sizes[rank]; done += MAX_WINDOW_SIZE) {
+                    size_t len = std::min<size_t>(MAX_WINDOW_SIZE, packed_sizes[rank] - done);
+                    unsigned char* place = stream ? blocks.data() + offset + done : nullptr;
+                    if (rank == world_rank && stream) {
+                        std::copy(packed.begin() + done, packed.begin() + done + len, place);
+                    }
+                    if (options.use_mpi_io) {
+                        MPI_Bcast(place, len, MPI_UNSIGNED_CHAR, rank, comm);
+                    } else if (rank != 0 && world_rank == 0) {
+                        MPI_Recv(place, len, MPI_UNSIGNED_CHAR, rank, 13, comm, MPI_STATUS_IGNORE);
+                    } else if (rank != 0 && world_rank == rank) {
+                        MPI_Send(packed.data() + done, len, MPI_UNSIGNED_CHAR, 0, 13, comm);
+                    }
+                }
+                offset += packed_sizes[rank];
+            }
+            if (stream) {
+                stream->keep_blocks(std::move(blocks));
+            }
+        }
+    } catch (const std::exception& e) {
+        // as in transform_job(): the other ranks may be waiting in a collective
+        std::cerr << "Error: " << e.what() << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    if (world_rank == 0) {
+        std::cout << "Rank 0: Compressed " << total_size << " bytes to " << stream->size() << " bytes in "
+                  << MPI_Wtime() - start_time << " s." << std::endl;
+    }
+    return stream;
+}
+
+// Runs one job on the ranks of `comm`; every rank gets the same result.
+// With --compress the ranks deflate the file in blocks before it is
+// encrypted, so every later stage (scatter, cipher, gather and disk) handles
+// the smaller stream, and rank 0 inflates the decrypted stream back into the
+// original.
+JobResult run_job(const Job& job, const JobOptions& options, MPI_Comm comm) {
+    if (options.compress_level == 0) {
+        return transform_job(job, options, comm);
+    }
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    if (job.operation == "encrypt") {
+        std::string error;
+        std::unique_ptr<ZBlockStream> stream = compress_input(job, options, comm, error);
+        if (!error.empty()) {
+            return JobResult{"", error};
+        }
+        return transform_job(job, options, comm, stream.get());
+    }
+
+    JobResult result = transform_job(job, options, comm);
+    if (!result.error.empty()) {
+        return result;
+    }
+    if (rank == 0) {
+        double start_time = MPI_Wtime();
+        std::string inflated = result.output_file + ".tmp";
+        long long size = decompress_file(result.output_file, inflated);
+        if (size < 0 || std::rename(inflated.c_str(), result.output_file.c_str()) != 0) {
+            std::remove(inflated.c_str());
+            std::remove(result.output_file.c_str());
+            result.error = "Decrypted data is not a --compress stream.";
+        } else {
+            std::cout << "Rank 0: Decompressed " << result.output_file << " to " << size << " bytes in "
+                      << MPI_Wtime() - start_time << " s." << std::endl;
+        }
+    }
+    if (!agree_on_error(result.error, comm)) {
+        result.output_file.clear();
+    }
+    return result;
+}
+
+// Polling interval of a rank that waits for rank 0 between jobs: it starts
+// short, so a job that arrives right away is not delayed, and doubles up to
+// the longest, which is about what an idle daemon rank then costs.
+constexpr std::chrono::microseconds IDLE_POLL_MIN(100);
+constexpr std::chrono::microseconds IDLE_POLL_MAX(10000);
+
+// Sends `line` from rank 0 to every rank. The other ranks may wait here for as
+// long as the daemon is idle, and a blocking MPI_Bcast would spin a core each
+// for all that time, so they test a non-blocking one and sleep in between.
+void broadcast_line(std::string& line) {
+    unsigned long length = line.size();
+    MPI_Request request;
+    MPI_Ibcast(&length, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD, &request);
+    int done = 0;
+    MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+    for (auto delay = IDLE_POLL_MIN; !done; delay = std::min(delay * 2, IDLE_POLL_MAX)) {
+        std::this_thread::sleep_for(delay);
+        MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+    }
+    line.resize(length);
+    MPI_Bcast(&line[0], length, MPI_CHAR, 0, MPI_COMM_WORLD);
+}
+
+// Splits a daemon request "<filename>\t<operation>\t<mode>\t<key>[\t<option>...]"
+// into a job and its options. Returns an error message or an empty string.
+std::string parse_job_line(const std::string& line, Job& job, JobOptions& options) {
+    std::vector<std::string> fields;
+    std::stringstream stream(line);
+    std::string field;
+    while (std::getline(stream, field, '\t')) {
+        fields.push_back(field);
+    }
+    if (fields.size() < 4) {
+        return "Expected <filename>\\t<operation>\\t<mode>\\t<key>[\\t<option>...].";
+    }
+
+    job = Job{fields[0], fields[1], fields[2], fields[3]};
+    for (size_t i = 4; i < fields.size(); i++) {
+        if (!parse_option(fields[i], options)) {
+            return "Invalid option " + fields[i] + ".";
+        }
+    }
+    if (job.key.size() != 16) {
+        return "Key must be 16 bytes for AES-128";
+    }
+    return check_job(job);
+}
+
+// Reads one newline-terminated request from a client connection.
+bool read_request(int client, std::string& line) {
+    char c;
+    line.clear();
+    while (line.size() < 65536) {
+        ssize_t n = ::read(client, &c, 1);
+        if (n <= 0) {
+            return false;
+        }
+        if (c == '\n') {
+            return true;
+        }
+        line += c;
+    }
+    return false;
+}
+
+void send_reply(int client, const std::string& reply) {
+    std::string message = reply + "\n";
+    send(client, message.data(), message.size(), MSG_NOSIGNAL);
+}
+
+// Daemon mode: the ranks stay up across jobs so each one skips the mpirun
+// launch, the ssh connection to the other hosts and process start-up. Rank 0
+// accepts one request per connection on a Unix socket, broadcasts it and
+// replies "OK <output file>" or "ERROR <reason>"; "shutdown" stops every rank.
+// A job that fails is answered with its error and the daemon takes the next
+// one; only errors the ranks cannot agree on, like running out of memory,
+// still abort the whole MPI job.
+void serve(const std::string& socket_path, const JobOptions& defaults, int world_rank) {
+    int server = -1;
+    if (world_rank == 0) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path)) {
+            std::cerr << "Socket path is too long." << std::endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        std::copy(socket_path.begin(), socket_path.end(), address.sun_path);
+
+        unlink(socket_path.c_str());
+        server = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (server < 0 || bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(server, 16) != 0) {
+            std::cerr << "Error listening on " << socket_path << "." << std::endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        std::cout << "Rank 0: Waiting for jobs on " << socket_path << "." << std::endl;
+    }
+
+    while (true) {
+        std::string line;
+        int client = -1;
+        if (world_rank == 0) {
+            // invalid requests are answered here and never reach the other ranks
+            while (true) {
+                client = accept(server, nullptr, nullptr);
+                if (client < 0) {
+                    continue;
+                }
+                Job job;
+                JobOptions options = defaults;
+                std::string error;
+                if (!read_request(client, line)) {
+                    error = "Incomplete request.";
+                } else if (line == "shutdown") {
+                    send_reply(client, "OK");
+                    ::close(client);
+                    line.clear();
+                    break;
+                } else if ((error = parse_job_line(line, job, options)).empty() && access(job.filename.c_str(), R_OK) != 0) {
+                    error = "Error opening input file.";
+                }
+                if (error.empty()) {
+                    break;
+                }
+                send_reply(client, "ERROR " + error);
+                ::close(client);
+            }
+        }
+
+        broadcast_line(line);
+        if (line.empty()) {
+            break;
+        }
+
+        Job job;
+        JobOptions options = defaults;
+        parse_job_line(line, job, options);
+        JobResult result = run_job(job, options, MPI_COMM_WORLD);
+
+        if (world_rank == 0) {
+            if (!result.error.empty()) {
+                std::cerr << "Rank 0: " << job.filename << ": " << result.error << std::endl;
+            }
+            send_reply(client, result.error.empty() ? "OK " + result.output_file : "ERROR " + result.error);
+            ::close(client);
+        }
+    }
+
+    if (world_rank == 0) {
+        ::close(server);
+        unlink(socket_path.c_str());
+    }
+}
+
+// Files below this size are processed whole by a single rank in batch mode;
+// larger ones are still split across all ranks.
+constexpr size_t BATCH_SPLIT_SIZE = 8 << 20;
+
+// Batch mode: runs every job of a manifest, one request line per file in the
+// --serve format ('#' starts a comment). Large files run one after another on
+// all ranks. Small ones are handed out one file per rank, biggest first: idle
+// ranks ask rank 0 for the next file and rank 0 works through the list itself
+// between requests, so a burst of small images keeps every rank busy instead
+// of splitting each image P ways.
+void run_batch(const std::string& manifest_path, const JobOptions& defaults, int world_rank, int world_size) {
+    std::string manifest;
+    if (world_rank == 0) {
+        std::ifstream manifest_file(manifest_path);
+        if (!manifest_file) {
+            std::cerr << "Error opening manifest file." << std::endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        std::stringstream contents;
+        contents << manifest_file.rdbuf();
+        manifest = contents.str();
+    }
+    broadcast_line(manifest);
+
+    std::vector<Job> jobs;
+    std::vector<JobOptions> job_options;
+    std::stringstream manifest_stream(manifest);
+    std::string line;
+    for (int line_number = 1; std::getline(manifest_stream, line); line_number++) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        Job job;
+        JobOptions options = defaults;
+        std::string error = parse_job_line(line, job, options);
+        if (!error.empty()) {
+            if (world_rank == 0) {
+                std::cerr << "Skipping manifest line " << line_number << ": " << error << std::endl;
+            }
+            continue;
+        }
+        jobs.push_back(job);
+        job_options.push_back(options);
+    }
+
+    // rank 0 sizes every input; -1 marks files it cannot open
+    std::vector<long long> sizes(jobs.size(), -1);
+    if (world_rank == 0) {
+        for (size_t i = 0; i < jobs.size(); i++) {
+            struct stat st;
+            if (stat(jobs[i].filename.c_str(), &st) == 0 && access(jobs[i].filename.c_str(), R_OK) == 0) {
+                sizes[i] = st.st_size;
+            } else {
+                std::cerr << "Skipping " << jobs[i].filename << ": Error opening input file." << std::endl;
+            }
+        }
+    }
+    MPI_Bcast(sizes.data(), sizes.size(), MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+
+    double start_time = MPI_Wtime();
+    long long my_files = 0;
+    long long my_bytes = 0;
+    std::vector<size_t> small_jobs;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (sizes[i] >= static_cast<long long>(BATCH_SPLIT_SIZE)) {
+            JobResult result = run_job(jobs[i], job_options[i], MPI_COMM_WORLD);
+            if (world_rank != 0) {
+                continue;
+            }
+            if (!result.error.empty()) {
+                std::cerr << "Skipping " << jobs[i].filename << ": " << result.error << std::endl;
+                continue;
+            }
+            my_files++;
+            my_bytes += sizes[i];
+        } else if (sizes[i] >= 0) {
+            small_jobs.push_back(i);
+        }
+    }
+    std::stable_sort(small_jobs.begin(), small_jobs.end(),
+                     [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+    auto run_small_job = [&](long long index) {
+        size_t i = small_jobs[index];
+        JobResult result = run_job(jobs[i], job_options[i], MPI_COMM_SELF);
+        if (!result.error.empty()) {
+            std::cerr << "Process " << world_rank << " skipping " << jobs[i].filename << ": " << result.error
+                      << std::endl;
+            return;
+        }
+        my_files++;
+        my_bytes += sizes[i];
+    };
+
+    if (world_rank == 0) {
+        // Waiting ranks are served before rank 0 takes the next file itself;
+        // once the list is empty every further request gets -1.
+        long long next = 0;
+        long long count = small_jobs.size();
+        int finished = 0;
+        while (finished < world_size - 1 || next < count) {
+            int waiting = 0;
+            MPI_Iprobe(MPI_ANY_SOURCE, 5, MPI_COMM_WORLD, &waiting, MPI_STATUS_IGNORE);
+            if (waiting || next >= count) {
+                MPI_Status status;
+                MPI_Recv(nullptr, 0, MPI_CHAR, MPI_ANY_SOURCE, 5, MPI_COMM_WORLD, &status);
+                long long index = next < count ? next++ : -1;
+                finished += index < 0 ? 1 : 0;
+                MPI_Send(&index, 1, MPI_LONG_LONG, status.MPI_SOURCE, 6, MPI_COMM_WORLD);
+            } else {
+                run_small_job(next++);
+            }
+        }
+    } else {
+        while (true) {
+            long long index;
+            MPI_Send(nullptr, 0, MPI_CHAR, 0, 5, MPI_COMM_WORLD);
+            MPI_Recv(&index, 1, MPI_LONG_LONG, 0, 6, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            if (index < 0) {
+                break;
+            }
+            run_small_job(index);
+        }
+    }
+
+    long long totals[2] = {my_files, my_bytes};
+    MPI_Reduce(world_rank == 0 ? MPI_IN_PLACE : totals, totals, 2, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    std::cout << "Process " << world_rank << " processed " << my_files << " files (" << my_bytes << " bytes)." << std::endl;
+    if (world_rank == 0) {
+        std::cout << "Rank 0: Processed " << totals[0] << " of " << jobs.size() << " files (" << totals[1]
+                  << " bytes) in " << MPI_Wtime() - start_time << " s." << std::endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    /*
+        argv[1] = filename
+        argv[2] = encrypt/decrypt
+        argv[3] = aes-128-cbc/aes-128-ecb/aes-128-ctr/aes-128-cbc-seg/aes-128-gcm
+        argv[4] = key
+        argv[5..] = options:
+            --mpi-io         every rank reads and writes its own range of a file
+                             on a shared volume instead of going through rank 0
+            --stream[=SIZE]  process the file in windows of SIZE bytes (default
+                             64M) so memory stays bounded whatever the file size
+            --mmap           map input and output files instead of copying them
+                             through buffers (rank 0, or every rank with --mpi-io)
+            --trace[=FILE]   write a Chrome trace of every rank's phases and threads
+                             (default <filename>_trace.json)
+            --dynamic[=SIZE] ranks pull units of SIZE bytes (default 4M) from rank 0
+                             on demand instead of taking fixed shares
+            --weights=FILE   seed --dynamic with each host's throughput from earlier
+                             jobs, and update FILE afterwards (implies --dynamic)
+            --compress[=N]   deflate the file in blocks at zlib level N (default 1)
+                             before encrypting, inflate it after decrypting
+
+        or, to keep the ranks running and take jobs from a Unix socket:
+        argv[1] = --serve
+        argv[2] = socket path
+        argv[3..] = options applied to every job
+
+        or, to run every job of a manifest file (one line per file, in the
+        --serve request format):
+        argv[1] = --batch
+        argv[2] = manifest path
+        argv[3..] = options applied to every job
+    */
+    bool daemon = argc >= 3 && std::string(argv[1]) == "--serve";
+    bool batch = argc >= 3 && std::string(argv[1]) == "--batch";
+    if (argc < 5 && !daemon && !batch) {
+        std::cerr << "Usage: " << argv[0] << "mpirun -np <n> --host <hosts> executable_mpi <filename> <encrypt/decrypt> <aes-128-cbc/aes-128-ecb/aes-128-ctr/aes-128-cbc-seg/aes-128-gcm> <key> [--mpi-io] [--stream[=SIZE]] [--mmap] [--trace[=FILE]] [--dynamic[=SIZE]] [--weights=FILE] [--compress[=N]]" << std::endl;
+        std::cerr << "       " << argv[0] << "mpirun -np <n> --host <hosts> executable_mpi --serve <socket> [options]" << std::endl;
+        std::cerr << "       " << argv[0] << "mpirun -np <n> --host <hosts> executable_mpi --batch <manifest> [options]" << std::endl;
+        return -1;
+    }
+
+    Job job;
+    if (!daemon && !batch) {
+        job = Job{argv[1], argv[2], argv[3], argv[4]};
+        std::string error = check_job(job);
+        if (!error.empty()) {
+            std::cerr << error << std::endl;
+            return -1;
+        }
+    }
+
+    JobOptions options;
+    for (int i = daemon || batch ? 3 : 5; i < argc; i++) {
+        if (!parse_option(argv[i], options)) {
+            std::cerr << "Invalid option " << argv[i] << "." << std::endl;
+            return -1;
+        }
+    }
+
+    MPI_Init(&argc, &argv);
+
+    int world_size;
+    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+
+    int world_rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+    char hostname[HOST_NAME_MAX];
+    gethostname(hostname, HOST_NAME_MAX);
+
+    // threads are only pinned when OMP_PLACES/OMP_PROC_BIND give them places
+    int places = omp_get_num_places();
+    std::cout << "Hello from process " << world_rank << " of " << world_size 
+              << " running on container: " << hostname << ", " << omp_get_max_threads() << " threads "
+              << (places > 0 ? "pinned to " + std::to_string(places) + " places" : "unpinned") << std::endl;
+
+    if (daemon) {
+        serve(argv[2], options, world_rank);
+    } else if (batch) {
+        run_batch(argv[2], options, world_rank, world_size);
+    } else {
+        JobResult result = run_job(job, options, MPI_COMM_WORLD);
+        if (!result.error.empty()) {
+            if (world_rank == 0) {
+                std::cerr << result.error << std::endl;
+            }
+            MPI_Finalize();
+            return 1;
+        }
+    }
+
     MPI_Finalize();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,79 @@
+#!/bin/bash
+# Encrypt/decrypt round trip for executable_mpi on a single machine.
+#
+# Encrypts a random file of each size in -s with every mode in -m at every
+# -np in -n, decrypts the result and compares it with the original. The
+# default sizes include whole multiples of the 1 MiB segment, whose
+# segmented ciphertext ends in a tail shorter than a segment. Options after
+# -- go to both runs, e.g. -- --dynamic.
+#
+#   ./roundtrip.sh [-b executable_mpi] [-n "1 3"] [-s "1M 4M 4194404"]
+#                  [-m "aes-128-cbc-seg aes-128-gcm"] [-- executable_mpi options]
+#
+# Exits with 1 after the sweep if any round trip failed.
+set -euo pipefail
+
+BIN=./executable_mpi
+NPS="1 3"
+SIZES="1000 1M 4M 4194404"
+MODES="aes-128-ecb aes-128-cbc aes-128-ctr aes-128-cbc-seg aes-128-gcm"
+KEY=0123456789abcdef
+
+usage() {
+    sed -n '2,13p' "$0" | sed 's/^# \{0,1\}//'
+    exit "${1:-0}"
+}
+
+while getopts "b:n:s:m:h" opt; do
+    case $opt in
+        b) BIN=$OPTARG ;;
+        n) NPS=$OPTARG ;;
+        s) SIZES=$OPTARG ;;
+        m) MODES=$OPTARG ;;
+        h) usage 0 ;;
+        *) usage 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+EXTRA=("$@")
+
+BIN=$(realpath "$BIN")
+if [ ! -x "$BIN" ]; then
+    echo "Error: $BIN is not executable." >&2
+    exit 1
+fi
+
+# as in scaling.sh; MPIRUN_ARGS replaces these defaults
+read -r -a MPIRUN <<< "${MPIRUN_ARGS:---oversubscribe --bind-to none --mca btl self,vader}"
+if [ "$(id -u)" -eq 0 ]; then
+    MPIRUN+=(--allow-run-as-root)
+fi
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+failed=0
+for size in $SIZES; do
+    bytes=$(numfmt --from=iec "$size")
+    head -c "$bytes" /dev/urandom > "$DIR/in.bmp"
+    for mode in $MODES; do
+        for np in $NPS; do
+            rm -f "$DIR"/in_output*
+            what="$mode np=$np size=$bytes${EXTRA[*]:+ ${EXTRA[*]}}"
+            if ! mpirun "${MPIRUN[@]}" -np "$np" "$BIN" "$DIR/in.bmp" encrypt "$mode" "$KEY" "${EXTRA[@]}" \
+                    > "$DIR/log" 2>&1 ||
+               ! mpirun "${MPIRUN[@]}" -np "$np" "$BIN" "$DIR/in_output.bin" decrypt "$mode" "$KEY" "${EXTRA[@]}" \
+                    >> "$DIR/log" 2>&1; then
+                echo "FAIL $what:" >&2
+                grep -v -e '^Hello from' -e '^Rank ' "$DIR/log" | head -n 3 >&2
+                failed=1
+            elif ! cmp -s "$DIR/in.bmp" "$DIR/in_output_outputdecrypted.bmp"; then
+                echo "FAIL $what: decrypted file differs" >&2
+                failed=1
+            else
+                echo "ok   $what"
+            fi
+        done
+    done
+done
+exit $failed
@@ -0,0 +1,188 @@
+#!/bin/bash
+# Strong and weak scaling sweep for executable_mpi on a single machine.
+#
+# Runs every -np x OMP_NUM_THREADS combination with oversubscribed ranks and
+# shared-memory transport only, so it needs no network and no hostfile.
+# Strong scaling encrypts each size in -s with every combination. Weak scaling
+# gives each worker (rank x thread) the first size in -s. Each run is repeated
+# and the best time is kept.
+#
+#   ./scaling.sh [-b executable_mpi] [-n "1 2 4"] [-t "1 2 4"] [-s "16M 64M"]
+#                [-m aes-128-ctr] [-r 3] [-o outdir] [-- executable_mpi options]
+#
+# Writes results.csv (every run), summary.csv (best time, speedup and
+# efficiency per phase) and report.md to the output directory.
+set -euo pipefail
+
+BIN=./executable_mpi
+NPS="1 2 4"
+THREADS="1 2 4"
+SIZES="16M 64M 256M"
+MODE=aes-128-ctr
+REPEATS=3
+OUT=scaling-$(date +%Y%m%d-%H%M%S)
+KEY=0123456789abcdef
+
+usage() {
+    sed -n '2,15p' "$0" | sed 's/^# \{0,1\}//'
+    exit "${1:-0}"
+}
+
+while getopts "b:n:t:s:m:r:o:h" opt; do
+    case $opt in
+        b) BIN=$OPTARG ;;
+        n) NPS=$OPTARG ;;
+        t) THREADS=$OPTARG ;;
+        s) SIZES=$OPTARG ;;
+        m) MODE=$OPTARG ;;
+        r) REPEATS=$OPTARG ;;
+        o) OUT=$OPTARG ;;
+        h) usage 0 ;;
+        *) usage 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+EXTRA=("$@")
+
+BIN=$(realpath "$BIN")
+if [ ! -x "$BIN" ]; then
+    echo "Error: $BIN is not executable." >&2
+    exit 1
+fi
+
+# local only: oversubscribed ranks that may each run several threads, and
+# shared memory between them. MPIRUN_ARGS replaces these defaults.
+read -r -a MPIRUN <<< "${MPIRUN_ARGS:---oversubscribe --bind-to none --mca btl self,vader}"
+if [ "$(id -u)" -eq 0 ]; then
+    MPIRUN+=(--allow-run-as-root)
+fi
+
+mkdir -p "$OUT/data" "$OUT/logs"
+RESULTS=$OUT/results.csv
+echo "kind,np,threads,size,repeat,phase,seconds" > "$RESULTS"
+
+input_file() {
+    local file=$OUT/data/in_$1.bin
+    if [ ! -f "$file" ]; then
+        head -c "$1" /dev/urandom > "$file"
+    fi
+    echo "$file"
+}
+
+# run_one <kind> <np> <threads> <bytes>
+run_one() {
+    local kind=$1 np=$2 threads=$3 bytes=$4
+    local input
+    input=$(input_file "$bytes")
+
+    for repeat in $(seq 1 "$REPEATS"); do
+        local log=$OUT/logs/$kind-np$np-t$threads-$bytes-$repeat.log
+        local start end
+        start=$(date +%s.%N)
+        if ! OMP_NUM_THREADS=$threads mpirun "${MPIRUN[@]}" -np "$np" -x OMP_NUM_THREADS \
+                "$BIN" "$input" encrypt "$MODE" "$KEY" "${EXTRA[@]}" > "$log" 2>&1; then
+            echo "Error: run failed, see $log" >&2
+            exit 1
+        fi
+        end=$(date +%s.%N)
+        rm -f "${input%.bin}_output.bin"
+        local wall
+        wall=$(awk -v start="$start" -v end="$end" 'BEGIN { print end - start }')
+
+        # "job" is rank 0's own time from keying to the written output; the
+        # rest of the wall time is mpirun, MPI_Init and MPI_Finalize
+        local job phases
+        job=$(sed -n 's/^Rank 0: Wrote .* in \([0-9.e+-]*\) s\.$/\1/p' "$log" | tail -n 1)
+        # "read=.. broadcast=.. ... total=.." from the per-phase summary line
+        phases=$(sed -n 's/^Rank 0: Phase times ([^)]*): \(.*\) -> .*$/\1/p' "$log" | tail -n 1)
+        awk -v kind="$kind" -v np="$np" -v t="$threads" -v size="$bytes" -v r="$repeat" \
+            -v wall="$wall" -v job="$job" -v phases="$phases" 'BEGIN {
+                prefix = kind "," np "," t "," size "," r
+                print prefix ",wall," wall
+                if (job != "") {
+                    print prefix ",job," job
+                    print prefix ",launch," wall - job
+                }
+                n = split(phases, pairs, " ")
+                for (i = 1; i <= n; i++) {
+                    split(pairs[i], pair, "=")
+                    if (pair[1] != "total") {
+                        print prefix "," pair[1] "," pair[2]
+                    }
+                }
+            }' >> "$RESULTS"
+        echo "$kind np=$np threads=$threads size=$bytes run $repeat: $wall s" >&2
+    done
+}
+
+for size in $SIZES; do
+    bytes=$(numfmt --from=iec "$size")
+    for np in $NPS; do
+        for threads in $THREADS; do
+            run_one strong "$np" "$threads" "$bytes"
+        done
+    done
+done
+
+base=$(numfmt --from=iec "${SIZES%% *}")
+for np in $NPS; do
+    for threads in $THREADS; do
+        run_one weak "$np" "$threads" $((base * np * threads))
+    done
+done
+
+# Best time per configuration and phase. Strong scaling compares against the
+# smallest worker count at the same size: speedup = T(base) / T, efficiency =
+# speedup * workers(base) / workers. Weak scaling: efficiency = T(base) / T.
+awk -F, 'NR > 1 {
+        key = $1 FS $2 FS $3 FS $4 FS $6
+        if (!(key in best) || $7 < best[key]) {
+            best[key] = $7
+        }
+    }
+    END {
+        for (key in best) {
+            split(key, f, FS)
+            workers = f[2] * f[3]
+            group = f[1] FS (f[1] == "strong" ? f[4] : "") FS f[5]
+            if (!(group in base_workers) || workers < base_workers[group]) {
+                base_workers[group] = workers
+                base_time[group] = best[key]
+            }
+        }
+        print "kind,np,threads,workers,size,phase,seconds,speedup,efficiency"
+        for (key in best) {
+            split(key, f, FS)
+            workers = f[2] * f[3]
+            group = f[1] FS (f[1] == "strong" ? f[4] : "") FS f[5]
+            speedup = best[key] > 0 ? base_time[group] / best[key] : 0
+            efficiency = f[1] == "strong" ? speedup * base_workers[group] / workers : speedup
+            printf "%s,%s,%s,%d,%s,%s,%.4f,%.3f,%.3f\n", f[1], f[2], f[3], workers, f[4], f[5], best[key],
+                   speedup, efficiency
+        }
+    }' "$RESULTS" | {
+        read -r header
+        echo "$header"
+        sort -t, -k1,1r -k6,6 -k5,5n -k4,4n -k2,2n
+    } > "$OUT/summary.csv"
+
+{
+    echo "# Scaling report"
+    echo
+    echo "$(basename "$BIN") $MODE${EXTRA[*]:+ ${EXTRA[*]}}, best of $REPEATS runs on $(hostname) ($(nproc) cores)."
+    echo "Phases: wall = whole mpirun, job = rank 0 from keying to written output, launch = wall - job;"
+    echo "read to finalize are the slowest rank's time in each phase of the job."
+    for kind in strong weak; do
+        echo
+        echo "## ${kind^} scaling"
+        echo
+        echo "| phase | size | np | threads | workers | seconds | speedup | efficiency |"
+        echo "|---|---:|---:|---:|---:|---:|---:|---:|"
+        awk -F, -v kind="$kind" 'NR > 1 && $1 == kind {
+            printf "| %s | %s | %s | %s | %s | %s | %s | %s |\n", $6, $5, $2, $3, $4, $7, $8, $9
+        }' "$OUT/summary.csv"
+    done
+} > "$OUT/report.md"
+
+rm -rf "$OUT/data"
+echo "Wrote $OUT/report.md"
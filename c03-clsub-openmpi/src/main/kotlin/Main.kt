@@ -8,6 +8,11 @@ import okhttp3.OkHttpClient
 import okhttp3.Request
 import okhttp3.RequestBody
 import java.io.File
+import java.io.IOException
+import java.net.UnixDomainSocketAddress
+import java.nio.ByteBuffer
+import java.nio.channels.Channels
+import java.nio.channels.SocketChannel
 import java.util.Base64
 import com.fasterxml.jackson.databind.ObjectMapper
 import okhttp3.RequestBody.Companion.toRequestBody
@@ -15,6 +20,29 @@ import okhttp3.RequestBody.Companion.toRequestBody
 val mapper = ObjectMapper()
 val client = OkHttpClient()
 
+// executable_mpi daemon started by start.sh (mpirun ... executable_mpi --serve)
+const val DAEMON_SOCKET = "/tmp/executable_mpi.sock"
+
+// --weights file of the daemon in start.sh; the per-job fallback reads and
+// updates the same one
+const val WEIGHTS_FILE = "/app/executable_mpi.weights"
+
+// Hands the job to the running MPI daemon. Returns whether it succeeded, or null
+// if no daemon is listening so the caller can fall back to its own mpirun.
+fun runOnDaemon(fields: List<String>): Boolean? {
+    if (!File(DAEMON_SOCKET).exists()) return null
+    return try {
+        SocketChannel.open(UnixDomainSocketAddress.of(DAEMON_SOCKET)).use { channel ->
+            channel.write(ByteBuffer.wrap((fields.joinToString("\t") + "\n").toByteArray()))
+            val reply = Channels.newInputStream(channel).bufferedReader().readLine() ?: ""
+            println("Daemon replied: $reply")
+            reply.startsWith("OK")
+        }
+    } catch (e: IOException) {
+        null
+    }
+}
+
 fun postRequest(url: String, params: Map<String, String>): String {
     val jsonBody = mapper.writeValueAsString(params)
     val mediaType = "application/json; charset=utf-8".toMediaType()
@@ -69,21 +97,30 @@ fun main() {
         val encMode = when (mode) {
             "ECB" -> "aes-128-ecb"
             "CBC" -> "aes-128-cbc"
+            "CTR" -> "aes-128-ctr"
+            "CBC-SEG" -> "aes-128-cbc-seg"
+            "GCM" -> "aes-128-gcm"
             else -> "aes-128-cbc"
         }
 
         try {
-            val projectDir = File(System.getProperty("user.dir"))
-            val executable = File(projectDir, "executable_mpi")
-
-            val process = ProcessBuilder("mpirun", "-np", "2", "--host", "c03,c04", executable.absolutePath, fileNameToBeSaved, operation, encMode, key)
-                .redirectErrorStream(true)
-                .start()
-            process.inputStream.bufferedReader().use{reader->
-                reader.lines().forEach { line -> println(line) }
-            }
+            val exitCode = when (runOnDaemon(listOf(File(fileNameToBeSaved).absolutePath, operation, encMode, key))) {
+                true -> 0
+                false -> 1
+                null -> {
+                    val projectDir = File(System.getProperty("user.dir"))
+                    val executable = File(projectDir, "executable_mpi")
+
+                    val process = ProcessBuilder("mpirun", "-np", "2", "--host", "c03,c04", "--bind-to", "none", "-x", "OMP_PLACES", "-x", "OMP_PROC_BIND", executable.absolutePath, fileNameToBeSaved, operation, encMode, key, "--dynamic", "--weights=$WEIGHTS_FILE")
+                        .redirectErrorStream(true)
+                        .start()
+                    process.inputStream.bufferedReader().use{reader->
+                        reader.lines().forEach { line -> println(line) }
+                    }
 
-            val exitCode = process.waitFor()
+                    process.waitFor()
+                }
+            }
             println("Process finished with exit code: $exitCode")
             if (exitCode != 0) {
                 channel.basicPublish(EXCHANGE_NAME, "recieve.$userId.$imageNameWithoutExtension", null, "Process finished with error".toByteArray())